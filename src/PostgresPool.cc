@@ -0,0 +1,230 @@
+// See the file "COPYING" in the main distribution directory for copyright.
+
+#include <cstring>
+#include <map>
+
+#include "PostgresPool.h"
+
+using namespace logging::writer;
+
+static std::mutex pools_mutex;
+static std::map<std::string, std::unique_ptr<ConnectionPool>> pools;
+static std::map<std::string, std::unique_ptr<SharedConnection>> shared_connections;
+
+ConnectionPool* ConnectionPool::Get(const std::string& conninfo, size_t size)
+	{
+	std::lock_guard<std::mutex> lock(pools_mutex);
+
+	auto& pool = pools[conninfo];
+	if ( ! pool )
+		pool = std::unique_ptr<ConnectionPool>(new ConnectionPool(conninfo, size > 0 ? size : 1));
+
+	return pool.get();
+	}
+
+std::vector<ConnectionPool::ConnectionStats> ConnectionPool::Stats()
+	{
+	std::vector<ConnectionStats> stats;
+	std::lock_guard<std::mutex> lock(pools_mutex);
+
+	for ( auto& pool : pools )
+		pool.second->AppendStats(stats);
+
+	return stats;
+	}
+
+ConnectionPool::ConnectionPool(const std::string& arg_conninfo, size_t arg_size)
+	: conninfo(arg_conninfo), size(arg_size)
+	{
+	// name the pool after database and host, leaving out credentials
+	std::string dbname;
+	std::string host;
+
+	PQconninfoOption* options = PQconninfoParse(conninfo.c_str(), nullptr);
+	if ( options )
+		{
+		for ( PQconninfoOption* option = options; option->keyword; ++option )
+			{
+			if ( option->val == nullptr )
+				continue;
+
+			if ( strcmp(option->keyword, "dbname") == 0 )
+				dbname = option->val;
+			else if ( strcmp(option->keyword, "host") == 0 )
+				host = option->val;
+			}
+
+		PQconninfoFree(options);
+		}
+
+	name = dbname;
+	if ( ! host.empty() )
+		name += "@" + host;
+	}
+
+ConnectionPool::~ConnectionPool()
+	{
+	for ( auto& connection : connections )
+		{
+		if ( connection->conn )
+			PQfinish(connection->conn);
+		}
+	}
+
+PooledConnection* ConnectionPool::Acquire(const std::string& statement, std::string& error)
+	{
+	std::unique_lock<std::mutex> lock(mutex);
+	PooledConnection* connection = nullptr;
+
+	for ( ;; )
+		{
+		for ( auto& c : connections )
+			{
+			if ( c->in_use )
+				continue;
+
+			if ( c->prepared.count(statement) > 0 )
+				{
+				connection = c.get();
+				break;
+				}
+
+			if ( ! connection )
+				connection = c.get();
+			}
+
+		if ( connection )
+			break;
+
+		if ( connections.size() < size )
+			{
+			auto c = std::make_unique<PooledConnection>();
+			c->conn = nullptr;
+			c->in_use = false;
+			c->borrows = 0;
+			c->busy = std::chrono::steady_clock::duration::zero();
+			c->created = std::chrono::steady_clock::now();
+
+			connection = c.get();
+			connections.push_back(std::move(c));
+			break;
+			}
+
+		available.wait(lock);
+		}
+
+	connection->in_use = true;
+	connection->borrows++;
+	connection->borrowed = std::chrono::steady_clock::now();
+
+	// the connection is ours now; (re)connecting does not block the other writers
+	lock.unlock();
+
+	if ( connection->conn == nullptr || PQstatus(connection->conn) != CONNECTION_OK )
+		{
+		if ( connection->conn == nullptr )
+			connection->conn = PQconnectdb(conninfo.c_str());
+		else
+			PQreset(connection->conn);
+
+		connection->ClearSession();
+
+		if ( PQstatus(connection->conn) != CONNECTION_OK )
+			{
+			error = PQerrorMessage(connection->conn);
+			Release(connection);
+			return nullptr;
+			}
+		}
+
+	return connection;
+	}
+
+void ConnectionPool::Release(PooledConnection* connection)
+	{
+	PGconn* conn = connection->conn;
+	bool clean = PQstatus(conn) == CONNECTION_OK && PQtransactionStatus(conn) == PQTRANS_IDLE;
+
+#ifdef LIBPQ_HAS_PIPELINING
+	clean = clean && PQpipelineStatus(conn) == PQ_PIPELINE_OFF;
+#endif
+
+	if ( ! clean )
+		{
+		// reconnected when it is borrowed the next time
+		PQfinish(conn);
+		connection->conn = nullptr;
+		}
+
+	std::lock_guard<std::mutex> lock(mutex);
+	connection->in_use = false;
+	connection->busy += std::chrono::steady_clock::now() - connection->borrowed;
+	available.notify_one();
+	}
+
+void ConnectionPool::AppendStats(std::vector<ConnectionStats>& stats)
+	{
+	std::lock_guard<std::mutex> lock(mutex);
+	auto now = std::chrono::steady_clock::now();
+
+	for ( size_t i = 0; i < connections.size(); ++i )
+		{
+		const PooledConnection& c = *connections[i];
+
+		auto busy = c.busy;
+		if ( c.in_use )
+			busy += now - c.borrowed;
+
+		auto age = now - c.created;
+
+		ConnectionStats s;
+		s.pool = name;
+		s.index = i;
+		s.in_use = c.in_use;
+		// only written by the borrower; not meaningful while the connection is in use
+		s.connected = c.in_use || c.conn != nullptr;
+		s.borrows = c.borrows;
+		s.busy = std::chrono::duration<double>(busy).count();
+		s.utilization = age.count() > 0 ? static_cast<double>(busy.count()) / age.count() : 0;
+		stats.push_back(s);
+		}
+	}
+
+SharedConnection* SharedConnection::Get(const std::string& conninfo)
+	{
+	std::lock_guard<std::mutex> lock(pools_mutex);
+
+	auto& shared = shared_connections[conninfo];
+	if ( ! shared )
+		shared = std::unique_ptr<SharedConnection>(new SharedConnection(conninfo));
+
+	return shared.get();
+	}
+
+SharedConnection::SharedConnection(const std::string& arg_conninfo)
+	: conninfo(arg_conninfo), conn(nullptr)
+	{
+	}
+
+SharedConnection::~SharedConnection()
+	{
+	if ( conn )
+		PQfinish(conn);
+	}
+
+PGresult* SharedConnection::Exec(const std::string& statement, int nparams, const char* const* values, std::string& error)
+	{
+	std::lock_guard<std::mutex> lock(mutex);
+
+	if ( conn == nullptr )
+		conn = PQconnectdb(conninfo.c_str());
+	else if ( PQstatus(conn) != CONNECTION_OK )
+		PQreset(conn);
+
+	PGresult* res = nullptr;
+	if ( PQstatus(conn) == CONNECTION_OK )
+		res = PQexecParams(conn, statement.c_str(), nparams, NULL, values, NULL, NULL, 0);
+
+	error = PQerrorMessage(conn);
+	return res;
+	}
@@ -0,0 +1,111 @@
+// See the file "COPYING" in the main distribution directory for copyright.
+//
+// Process-wide pool of database connections shared by the PostgreSQL writers.
+
+#ifndef LOGGING_WRITER_POSTGRES_POOL_H
+#define LOGGING_WRITER_POSTGRES_POOL_H
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "libpq-fe.h"
+
+namespace logging { namespace writer {
+
+// A connection of a ConnectionPool. While a writer borrowed it, only that writer uses it.
+struct PooledConnection {
+	PGconn* conn;
+	std::set<std::string> prepared; // statements prepared on this connection
+	std::string synchronous_commit; // value set on this connection; empty for the server default
+
+	bool in_use;
+	uint64_t borrows;
+	std::chrono::steady_clock::duration busy; // total time the connection was borrowed
+	std::chrono::steady_clock::time_point created;
+	std::chrono::steady_clock::time_point borrowed;
+
+	// forgets the session state; called after the connection was re-established
+	void ClearSession()	{ prepared.clear(); synchronous_commit.clear(); }
+};
+
+// Pool of connections to one database, shared by all writer threads using the same
+// connection string. Connections are opened when they are needed for the first time.
+class ConnectionPool {
+public:
+	struct ConnectionStats {
+		std::string pool; // database and host; the connection string may contain passwords
+		uint64_t index;
+		bool in_use;
+		bool connected;
+		uint64_t borrows;
+		double busy; // seconds
+		double utilization; // fraction of the lifetime of the connection it was borrowed
+	};
+
+	// Returns the pool for conninfo, creating it with the given maximum number of
+	// connections if it does not exist yet.
+	static ConnectionPool* Get(const std::string& conninfo, size_t size);
+
+	// utilization of the connections of all pools
+	static std::vector<ConnectionStats> Stats();
+
+	~ConnectionPool();
+
+	// Borrows a connection, waiting until one is available. Connections that have the
+	// given statement prepared are preferred. Broken connections are re-established.
+	// Returns nullptr and sets error if connecting failed.
+	PooledConnection* Acquire(const std::string& statement, std::string& error);
+
+	// Returns a borrowed connection. Connections in the middle of a transaction, a COPY or
+	// a pipeline are closed, as the next borrower could not use them.
+	void Release(PooledConnection* connection);
+
+private:
+	ConnectionPool(const std::string& conninfo, size_t size);
+
+	void AppendStats(std::vector<ConnectionStats>& stats);
+
+	std::string conninfo;
+	std::string name;
+	size_t size;
+
+	std::mutex mutex;
+	std::condition_variable available;
+	std::vector<std::unique_ptr<PooledConnection>> connections;
+};
+
+// A single connection per connection string, shared by all writers of the process, for
+// short statements that are committed right away: new enum labels and dictionary values.
+// It is not taken from a ConnectionPool, as writers need it while they hold a pooled
+// connection; writers take turns using it.
+class SharedConnection {
+public:
+	// Returns the shared connection for conninfo, creating it if it does not exist yet.
+	// The connection is opened when the first statement is executed.
+	static SharedConnection* Get(const std::string& conninfo);
+
+	~SharedConnection();
+
+	// Executes a statement, (re)connecting first if necessary. Returns its result, or
+	// nullptr if connecting failed; error is set to the last error of the connection.
+	PGresult* Exec(const std::string& statement, int nparams, const char* const* values, std::string& error);
+
+private:
+	explicit SharedConnection(const std::string& conninfo);
+
+	std::string conninfo;
+
+	std::mutex mutex;
+	PGconn* conn;
+};
+
+}
+}
+
+#endif /* LOGGING_WRITER_POSTGRES_POOL_H */
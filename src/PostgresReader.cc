@@ -1,6 +1,14 @@
 // See the file "COPYING" in the main distribution directory for copyright.
 
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <climits>
+#include <cstring>
+#include <cmath>
+#include <ctime>
 #include <regex>
+#include <set>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd.h>
@@ -16,6 +24,51 @@ using namespace input::reader;
 using zeek::threading::Value;
 using zeek::threading::Field;
 
+// type oids from pg_type.h; the server headers are not available to clients
+#define BOOLOID 16
+#define NAMEOID 19
+#define INT8OID 20
+#define INT2OID 21
+#define INT4OID 23
+#define TEXTOID 25
+#define CIDROID 650
+#define FLOAT4OID 700
+#define FLOAT8OID 701
+#define INETOID 869
+#define BPCHAROID 1042
+#define VARCHAROID 1043
+#define TIMESTAMPOID 1114
+#define TIMESTAMPTZOID 1184
+#define INTERVALOID 1186
+#define BOOLARRAYOID 1000
+#define INT2ARRAYOID 1005
+#define INT4ARRAYOID 1007
+#define TEXTARRAYOID 1009
+#define VARCHARARRAYOID 1015
+#define INT8ARRAYOID 1016
+#define FLOAT4ARRAYOID 1021
+#define FLOAT8ARRAYOID 1022
+#define INETARRAYOID 1041
+#define CIDRARRAYOID 651
+#define TIMESTAMPARRAYOID 1115
+#define TIMESTAMPTZARRAYOID 1185
+#define INTERVALARRAYOID 1187
+
+// name of the prepared query, and of the query for new rows in MODE_STREAM
+static const char* read_statement = "zeek_read";
+static const char* next_statement = "zeek_read_next";
+static const char* key_statement = "zeek_read_key";
+
+// strips a trailing semicolon and whitespace, so that the query can be used as subquery
+static std::string TrimQuery(const std::string& query)
+	{
+	size_t end = query.find_last_not_of("; \t\n");
+	return query.substr(0, end == std::string::npos ? 0 : end + 1);
+	}
+
+// seconds between the unix epoch and the PostgreSQL epoch, 2000-01-01
+static const double postgres_epoch = 946684800;
+
 
 PostgreSQL::PostgreSQL(zeek::input::ReaderFrontend *frontend) : zeek::input::ReaderBackend(frontend)
 	{
@@ -84,11 +137,153 @@ bool PostgreSQL::DoInit(const ReaderInfo& info, int arg_num_fields, const zeek::
 
 	query = info.source;
 
+	// positional parameters of the query, param1 for $1 and so on
+	params.clear();
+	for ( int i = 1; ; ++i )
+		{
+		std::string name = "param" + std::to_string(i);
+		auto it = info.config.find(name.c_str());
+		if ( it == info.config.end() )
+			break;
+
+		params.push_back(it->second);
+		}
+
+	// the watermark or key is passed after them
+	std::string extra_param = "$" + std::to_string(params.size() + 1);
+
+	// without chunked mode, streaming the result means one PGresult per row, which is
+	// slower than retrieving it at once, so it is only done by default with chunked mode
+#ifdef LIBPQ_HAS_CHUNK_MODE
+	fetch_size = 1000;
+#else
+	fetch_size = 0;
+#endif
+	poll_interval = 1;
+	if ( ! LookupCountParam(info, "fetch_size", fetch_size) ||
+	     ! LookupCountParam(info, "poll_interval", poll_interval) )
+		return false;
+
+	std::string binary = LookupParam(info, "binary_results");
+	binary_results = binary.empty() || binary == "T";
+
+	stream = info.mode == zeek::input::MODE_STREAM;
+	watermark_pos = -1;
+	has_watermark = false;
+	watermark_binary = false;
+	next_poll = 0;
+
+	if ( stream )
+		{
+		std::string column = LookupParam(info, "watermark_column");
+		if ( column.empty() )
+			{
+			Error("MODE_STREAM requires the watermark_column configuration option");
+			return false;
+			}
+
+		watermark_column = EscapeIdentifier(column.c_str());
+		if ( watermark_column.empty() )
+			return false;
+
+		// The first poll returns all rows, later ones only the rows with a watermark greater
+		// than the last one seen. These are separate statements, so that the latter can use
+		// an index on the watermark column.
+		std::string select = "SELECT * FROM (" + TrimQuery(query) + ") AS zeek_stream ";
+		query = select + "ORDER BY " + watermark_column;
+		next_query = select + "WHERE " + watermark_column + " > " + extra_param + " ORDER BY " + watermark_column;
+		}
+
+	notify_channel = LookupParam(info, "notify_channel");
+	if ( ! notify_channel.empty() )
+		{
+		notify_channel = EscapeIdentifier(notify_channel.c_str());
+		if ( notify_channel.empty() )
+			return false;
+
+		// notifications with a payload only update the rows with that key
+		std::string key = LookupParam(info, "notify_key_column");
+		if ( ! key.empty() && ! stream )
+			{
+			std::string column = EscapeIdentifier(key.c_str());
+			if ( column.empty() )
+				return false;
+
+			key_query = "SELECT * FROM (" + TrimQuery(query) + ") AS zeek_notify WHERE " + column + " = " + extra_param;
+			}
+		}
+
+	replication_mapped = false;
+
+	std::string publication = LookupParam(info, "publication");
+	if ( ! publication.empty() )
+		{
+		if ( stream || ! notify_channel.empty() )
+			{
+			Error("publication cannot be combined with MODE_STREAM or notify_channel");
+			return false;
+			}
+
+		std::string relation = LookupParam(info, "replication_table");
+		if ( relation.empty() )
+			{
+			Error("publication requires the replication_table configuration option");
+			return false;
+			}
+
+		std::string schema = "public";
+		size_t dot = relation.find('.');
+		if ( dot != std::string::npos )
+			{
+			schema = relation.substr(0, dot);
+			relation = relation.substr(dot + 1);
+			}
+
+		// temporary slots have to have unique names
+		std::string slot = LookupParam(info, "replication_slot");
+		if ( slot.empty() )
+			{
+			slot = std::string("zeek_") + info.name + "_" + std::to_string(getpid());
+			for ( char& c : slot )
+				c = isalnum(static_cast<unsigned char>(c)) ? tolower(static_cast<unsigned char>(c)) : '_';
+			}
+
+		replication = std::unique_ptr<ReplicationStream>(new ReplicationStream(conninfo, slot, publication, schema, relation));
+		replication_schema = schema;
+		replication_table = relation;
+		}
+
+	if ( ! SetupSession() )
+		return false;
+
+	if ( replication )
+		return CheckReplicaIdentity(replication_schema, replication_table) && StartReplication();
+
 	DoUpdate();
 
 	return true;
 	}
 
+// note - LookupCountParam is replicated in writer
+bool PostgreSQL::LookupCountParam(const ReaderInfo& info, const std::string name, uint64_t& value)
+	{
+	std::string str = LookupParam(info, name);
+	if ( str.empty() )
+		return true;
+
+	char* end;
+	errno = 0;
+	unsigned long long parsed = strtoull(str.c_str(), &end, 10);
+	if ( errno != 0 || *end != '\0' || str[0] == '-' )
+		{
+		Error(Fmt("Invalid value '%s' for configuration option %s", str.c_str(), name.c_str()));
+		return false;
+		}
+
+	value = parsed;
+	return true;
+	}
+
 // note - EscapeIdentifier is replicated in writer
 std::string PostgreSQL::EscapeIdentifier(const char* identifier)
 	{
@@ -104,7 +299,101 @@ std::string PostgreSQL::EscapeIdentifier(const char* identifier)
 	return out;
 	}
 
-std::unique_ptr<Value> PostgreSQL::EntryToVal(std::string s, const zeek::threading::Field* field)
+// Parses a timestamp or timestamptz in ISO DateStyle, e.g. "2020-01-01 12:00:00.5+00"
+bool PostgreSQL::ParseTimestamp(const std::string& s, double* time)
+	{
+	struct tm tm = {};
+	int consumed = 0;
+
+	if ( sscanf(s.c_str(), "%d-%d-%d %d:%d:%d%n", &tm.tm_year, &tm.tm_mon, &tm.tm_mday,
+		    &tm.tm_hour, &tm.tm_min, &tm.tm_sec, &consumed) != 6 )
+		return false;
+
+	tm.tm_year -= 1900;
+	tm.tm_mon -= 1;
+
+	const char* p = s.c_str() + consumed;
+	double fraction = 0;
+
+	if ( *p == '.' )
+		{
+		char* end;
+		fraction = strtod(p, &end);
+		p = end;
+		}
+
+	// offset from UTC; always +00 with our session time zone, but timestamps could be
+	// formatted by the query.
+	int offset = 0;
+	if ( *p == '+' || *p == '-' )
+		{
+		int sign = *p == '-' ? -1 : 1;
+		int hours = 0, minutes = 0, seconds = 0;
+		sscanf(p + 1, "%d:%d:%d", &hours, &minutes, &seconds);
+		offset = sign * (hours * 3600 + minutes * 60 + seconds);
+		}
+
+	*time = static_cast<double>(timegm(&tm)) - offset + fraction;
+	return true;
+	}
+
+// Parses an interval in the postgres IntervalStyle, e.g. "1 day -01:02:03.5". Months and years
+// do not have a fixed length; they are counted as 30 and 365.25 days, like PostgreSQL's
+// EXTRACT(EPOCH FROM interval) does.
+bool PostgreSQL::ParseInterval(const std::string& s, double* interval)
+	{
+	const char* p = s.c_str();
+	double total = 0;
+
+	for ( ;; )
+		{
+		while ( *p == ' ' )
+			++p;
+
+		if ( *p == '\0' )
+			break;
+
+		char* end;
+		double number = strtod(p, &end);
+		if ( end == p )
+			return false;
+
+		if ( *end == ':' )
+			{
+			// [-]HH:MM:SS[.ffffff]
+			int sign = *p == '-' ? -1 : 1;
+			int hours = 0, minutes = 0;
+			double seconds = 0;
+
+			if ( sscanf(p + (sign < 0 || *p == '+' ? 1 : 0), "%d:%d:%lf", &hours, &minutes, &seconds) != 3 )
+				return false;
+
+			total += sign * (hours * 3600.0 + minutes * 60.0 + seconds);
+			break;
+			}
+
+		p = end;
+		while ( *p == ' ' )
+			++p;
+
+		if ( strncmp(p, "year", 4) == 0 )
+			total += number * 365.25 * 86400;
+		else if ( strncmp(p, "mon", 3) == 0 )
+			total += number * 30 * 86400;
+		else if ( strncmp(p, "day", 3) == 0 )
+			total += number * 86400;
+		else
+			return false;
+
+		while ( *p != '\0' && *p != ' ' )
+			++p;
+		}
+
+	*interval = total;
+	return true;
+	}
+
+std::unique_ptr<Value> PostgreSQL::EntryToVal(std::string s, const zeek::threading::Field* field, Oid column_type)
 	{
 	std::unique_ptr<Value> val(new Value(field->type, true));
 
@@ -127,17 +416,40 @@ std::unique_ptr<Value> PostgreSQL::EntryToVal(std::string s, const zeek::threadi
 		break;
 
 	case zeek::TYPE_INT:
-		val->val.int_val = atoi(s.c_str());
+		val->val.int_val = strtoll(s.c_str(), nullptr, 10);
 		break;
 
-	case zeek::TYPE_DOUBLE:
 	case zeek::TYPE_TIME:
 	case zeek::TYPE_INTERVAL:
+		if ( column_type == TIMESTAMPTZOID || column_type == TIMESTAMPOID )
+			{
+			if ( ! ParseTimestamp(s, &val->val.double_val) )
+				{
+				Error(Fmt("Invalid value for timestamp: %s", s.c_str()));
+				return nullptr;
+				}
+			break;
+			}
+
+		if ( column_type == INTERVALOID )
+			{
+			if ( ! ParseInterval(s, &val->val.double_val) )
+				{
+				Error(Fmt("Invalid value for interval: %s", s.c_str()));
+				return nullptr;
+				}
+			break;
+			}
+
+		// double precision
+		// fall through
+
+	case zeek::TYPE_DOUBLE:
 		val->val.double_val = atof(s.c_str());
 		break;
 
 	case zeek::TYPE_COUNT:
-		val->val.uint_val = atoi(s.c_str());
+		val->val.uint_val = strtoull(s.c_str(), nullptr, 10);
 		break;
 
 	case zeek::TYPE_PORT:
@@ -198,6 +510,14 @@ std::unique_ptr<Value> PostgreSQL::EntryToVal(std::string s, const zeek::threadi
 		std::unique_ptr<Field> newfield(new Field(*field));
 		newfield->type = field->subtype;
 
+		Oid element_type = 0;
+		if ( column_type == TIMESTAMPTZARRAYOID )
+			element_type = TIMESTAMPTZOID;
+		else if ( column_type == TIMESTAMPARRAYOID )
+			element_type = TIMESTAMPOID;
+		else if ( column_type == INTERVALARRAYOID )
+			element_type = INTERVALOID;
+
 		std::vector<std::unique_ptr<Value>> vals;
 
 		int match_number = 0;
@@ -222,7 +542,7 @@ std::unique_ptr<Value> PostgreSQL::EntryToVal(std::string s, const zeek::threadi
 				vals.emplace_back(new Value(field->subtype, false));
 			else
 				{
-				auto newval = EntryToVal(element, newfield.get());
+				auto newval = EntryToVal(element, newfield.get(), element_type);
 				if ( newval == nullptr )
 					{
 					Error("Error while reading set");
@@ -265,18 +585,176 @@ std::unique_ptr<Value> PostgreSQL::EntryToVal(std::string s, const zeek::threadi
 
 	}
 
-bool PostgreSQL::DoUpdate()
+// element type of an array type; 0 for other types
+static Oid ElementType(Oid type)
+	{
+	switch ( type ) {
+	case BOOLARRAYOID:
+		return BOOLOID;
+	case INT2ARRAYOID:
+		return INT2OID;
+	case INT4ARRAYOID:
+		return INT4OID;
+	case INT8ARRAYOID:
+		return INT8OID;
+	case TEXTARRAYOID:
+		return TEXTOID;
+	case VARCHARARRAYOID:
+		return VARCHAROID;
+	case FLOAT4ARRAYOID:
+		return FLOAT4OID;
+	case FLOAT8ARRAYOID:
+		return FLOAT8OID;
+	case INETARRAYOID:
+		return INETOID;
+	case CIDRARRAYOID:
+		return CIDROID;
+	case TIMESTAMPARRAYOID:
+		return TIMESTAMPOID;
+	case TIMESTAMPTZARRAYOID:
+		return TIMESTAMPTZOID;
+	case INTERVALARRAYOID:
+		return INTERVALOID;
+	default:
+		return 0;
+	}
+	}
+
+// Prepares the query and maps its result columns once. Queries that cannot be prepared, like
+// ones consisting of several statements, are sent as they are on every update, with columns
+// being mapped for each result.
+bool PostgreSQL::Prepare()
 	{
-	PGresult *res = PQexecParams(conn, query.c_str(), 0, NULL, NULL, NULL, NULL, 0);
-	if (PQresultStatus(res) != PGRES_TUPLES_OK)
+	has_shape = false;
+
+	PGresult *res = PQprepare(conn, read_statement, query.c_str(), 0, NULL);
+	bool ok = PQresultStatus(res) == PGRES_COMMAND_OK;
+	PQclear(res);
+
+	if ( ok && stream )
 		{
-		Error(Fmt("PostgreSQL query failed: %s", PQerrorMessage(conn)));
+		res = PQprepare(conn, next_statement, next_query.c_str(), 0, NULL);
+		ok = PQresultStatus(res) == PGRES_COMMAND_OK;
+		PQclear(res);
+		}
+
+	if ( ok && ! key_query.empty() )
+		{
+		res = PQprepare(conn, key_statement, key_query.c_str(), 0, NULL);
+		ok = PQresultStatus(res) == PGRES_COMMAND_OK;
+		PQclear(res);
+		}
+
+	if ( ! ok && ( stream || ! key_query.empty() ) )
+		{
+		Error(Fmt("Could not prepare query: %s", PQerrorMessage(conn)));
+		return false;
+		}
+
+	if ( ! ok )
+		{
+		binary_results = false;
+		return true;
+		}
+
+	res = PQdescribePrepared(conn, read_statement);
+	if ( PQresultStatus(res) != PGRES_COMMAND_OK )
+		{
+		Error(Fmt("Could not describe query: %s", PQerrorMessage(conn)));
+		PQclear(res);
+		return false;
+		}
+
+	prepared = true;
+	ok = MapColumns(res);
+
+	if ( stream )
+		watermark_pos = PQfnumber(res, watermark_column.c_str());
+
+	PQclear(res);
+
+	return ok;
+	}
+
+// Fixes the text format of the native time and interval types, which we parse ourselves, and
+// prepares the query. Called again after reconnecting.
+bool PostgreSQL::SetupSession()
+	{
+	PGresult *res = PQexec(conn, "SET DateStyle TO ISO; SET TimeZone TO 'UTC'; SET IntervalStyle TO postgres;");
+	if ( PQresultStatus(res) != PGRES_COMMAND_OK )
+		{
+		Error(Fmt("Could not set up session: %s", PQerrorMessage(conn)));
+		PQclear(res);
+		return false;
+		}
+
+	PQclear(res);
+
+	if ( ! notify_channel.empty() )
+		{
+		res = PQexec(conn, ("LISTEN " + notify_channel + ";").c_str());
+		if ( PQresultStatus(res) != PGRES_COMMAND_OK )
+			{
+			Error(Fmt("Could not listen for notifications: %s", PQerrorMessage(conn)));
+			PQclear(res);
+			return false;
+			}
+
 		PQclear(res);
+		}
+
+	prepared = false;
+	return Prepare();
+	}
+
+// Re-establishes a lost connection. Returns false if the database is still unavailable.
+bool PostgreSQL::Reconnect()
+	{
+	PQreset(conn);
+
+	if ( PQstatus(conn) != CONNECTION_OK )
+		{
+		Warning(Fmt("Could not reconnect to pg: %s", PQerrorMessage(conn)));
+		return false;
+		}
+
+	return SetupSession();
+	}
+
+// remembers the names and types of the columns of a result, or forgets them without res
+void PostgreSQL::SetShape(const PGresult* res)
+	{
+	shape.clear();
+
+	for ( int i = 0; res && i < PQnfields(res); ++i )
+		shape.emplace_back(PQfname(res, i), PQftype(res, i));
+
+	has_shape = res != nullptr;
+	}
+
+// returns true if the columns of res are the ones remembered with SetShape
+bool PostgreSQL::SameShape(const PGresult* res) const
+	{
+	if ( ! has_shape || PQnfields(res) != static_cast<int>(shape.size()) )
 		return false;
+
+	for ( size_t i = 0; i < shape.size(); ++i )
+		{
+		if ( shape[i].second != PQftype(res, i) || shape[i].first != PQfname(res, i) )
+			return false;
 		}
 
-	std::vector<int> mapping;
-	mapping.reserve(num_fields);
+	return true;
+	}
+
+// Looks up the result columns of the fields, and of the protocols of ports. Chooses binary
+// results if they can be decoded for all of the columns.
+bool PostgreSQL::MapColumns(const PGresult* res)
+	{
+	columns.clear();
+	columns.reserve(num_fields);
+
+	bool binary = true;
 
 	for ( int i = 0; i < num_fields; ++i ) {
 		std::string fieldname = EscapeIdentifier(fields[i]->name);
@@ -287,63 +765,892 @@ bool PostgreSQL::DoUpdate()
 		if ( pos == -1 )
 			{
 			Error(Fmt("Field %s was not found in PostgreSQL result", fieldname.c_str()));
-			PQclear(res);
 			return false;
 			}
 
-		mapping.push_back(pos);
-	}
-
-	assert( mapping.size() == num_fields );
-
-	for ( int i = 0; i < PQntuples(res); ++i )
-		{
-		std::vector<std::unique_ptr<Value>> ovals;
-		//ovals.resize(num_fields);
+		Column column;
+		column.pos = pos;
+		column.proto = -1;
+		column.type = PQftype(res, pos);
+		column.array = false;
+		column.element_type = 0;
 
-		for ( int j = 0; j < num_fields; ++j )
+		// protocol columns of ports, written by the writer with native_types
+		if ( fields[i]->type == zeek::TYPE_PORT )
 			{
-			if ( PQgetisnull(res, i, mapping[j] ) == 1 )
-				ovals.emplace_back(std::unique_ptr<Value>(new Value(fields[j]->type, false)));
-			else
-				{
-				// PQgetvalue result will be cleaned up by PQclear.
-				std::string value (PQgetvalue(res, i, mapping[j]), PQgetlength(res, i, mapping[j]));
-				auto res = EntryToVal(value, fields[j]);
-				if ( res == nullptr )
-					{
-					// error occured, let's break out of this line. Just removing ovals will get rid of everything.
-					ovals.clear();
-					break;
-					}
+			std::string protoname = EscapeIdentifier((std::string(fields[i]->name) + "_proto").c_str());
+			column.proto = PQfnumber(res, protoname.c_str());
 
-				ovals.push_back(std::move(res));
-				}
+			if ( column.proto >= 0 && ResolveDecoder(zeek::TYPE_STRING, PQftype(res, column.proto)) != DECODER_TEXT )
+				binary = false;
 			}
 
-		// if there is an result, send it on :)
-		if ( ! ovals.empty() )
+		if ( fields[i]->type == zeek::TYPE_TABLE || fields[i]->type == zeek::TYPE_VECTOR )
 			{
-			assert( ovals.size() == num_fields );
-			Value** ofields = new Value*[num_fields];
+			column.element_field = std::unique_ptr<Field>(new Field(*fields[i]));
+			column.element_field->type = fields[i]->subtype;
+			column.element_type = ElementType(column.type);
+			column.array = column.element_type != 0;
+			}
 
-			for ( int i = 0; i < num_fields; ++i )
-				{
-				ofields[i] = ovals[i].release();
-				}
+		if ( column.array )
+			column.decoder = ResolveDecoder(fields[i]->subtype, column.element_type);
+		else if ( fields[i]->type == zeek::TYPE_TABLE || fields[i]->type == zeek::TYPE_VECTOR )
+			// lists stored as text are parsed by EntryToVal
+			column.decoder = ResolveDecoder(zeek::TYPE_STRING, column.type);
+		else
+			column.decoder = ResolveDecoder(fields[i]->type, column.type);
 
-			SendEntry(ofields);
-			}
-		}
+		if ( column.decoder == DECODER_NONE )
+			binary = false;
 
-	PQclear(res);
-	EndCurrentSend();
+		columns.push_back(std::move(column));
+	}
 
+	assert( columns.size() == num_fields );
+
+	binary_results = binary_results && binary;
 	return true;
 	}
 
-// currently we do not support streaming
-bool PostgreSQL::DoHeartbeat(double network_time, double current_time)
+// Returns the decoder for values of column_type read into fields of the given type, or
+// DECODER_NONE if the binary format of column_type is not supported for it.
+PostgreSQL::Decoder PostgreSQL::ResolveDecoder(zeek::TypeTag type, Oid column_type)
+	{
+	switch ( column_type ) {
+	// the binary format of these is the same as their text format
+	case TEXTOID:
+	case VARCHAROID:
+	case BPCHAROID:
+	case NAMEOID:
+		return DECODER_TEXT;
+
+	case BOOLOID:
+		return type == zeek::TYPE_BOOL ? DECODER_BOOL : DECODER_NONE;
+
+	case INT2OID:
+	case INT4OID:
+	case INT8OID:
+		if ( type != zeek::TYPE_INT && type != zeek::TYPE_COUNT && type != zeek::TYPE_PORT )
+			return DECODER_NONE;
+
+		return column_type == INT2OID ? DECODER_INT2 : column_type == INT4OID ? DECODER_INT4 : DECODER_INT8;
+
+	case FLOAT4OID:
+	case FLOAT8OID:
+		if ( type != zeek::TYPE_DOUBLE && type != zeek::TYPE_TIME && type != zeek::TYPE_INTERVAL )
+			return DECODER_NONE;
+
+		return column_type == FLOAT4OID ? DECODER_FLOAT4 : DECODER_FLOAT8;
+
+	case TIMESTAMPOID:
+	case TIMESTAMPTZOID:
+		return type == zeek::TYPE_TIME ? DECODER_TIMESTAMP : DECODER_NONE;
+
+	case INTERVALOID:
+		return type == zeek::TYPE_INTERVAL ? DECODER_INTERVAL : DECODER_NONE;
+
+	case INETOID:
+	case CIDROID:
+		return type == zeek::TYPE_ADDR || type == zeek::TYPE_SUBNET ? DECODER_INET : DECODER_NONE;
+
+	default:
+		return DECODER_NONE;
+	}
+	}
+
+// reads an integer of the given size in network byte order
+static uint64_t ReadNetwork(const char* data, int bytes)
+	{
+	uint64_t val = 0;
+	for ( int i = 0; i < bytes; ++i )
+		val = (val << 8) | static_cast<uint8_t>(data[i]);
+	return val;
+	}
+
+// Converts a value in the binary format of column_type, using the decoder resolved for it.
+std::unique_ptr<Value> PostgreSQL::BinaryToVal(const char* data, int length, const Field* field, Decoder decoder, Oid column_type)
 	{
+	if ( decoder == DECODER_TEXT )
+		return EntryToVal(std::string(data, length), field, column_type);
+
+	static const int sizes[] = { 0, 0, 1, 2, 4, 8, 4, 8, 8, 16, 0 };
+	if ( decoder != DECODER_INET && length != sizes[decoder] )
+		{
+		Error(Fmt("Invalid binary value for %s", field->name));
+		return nullptr;
+		}
+
+	std::unique_ptr<Value> val(new Value(field->type, true));
+
+	switch ( decoder ) {
+	case DECODER_BOOL:
+		val->val.int_val = data[0] != 0;
+		break;
+
+	case DECODER_INT2:
+	case DECODER_INT4:
+	case DECODER_INT8:
+		{
+		int64_t i;
+		if ( decoder == DECODER_INT2 )
+			i = static_cast<int16_t>(ReadNetwork(data, 2));
+		else if ( decoder == DECODER_INT4 )
+			i = static_cast<int32_t>(ReadNetwork(data, 4));
+		else
+			i = static_cast<int64_t>(ReadNetwork(data, 8));
+
+		if ( field->type == zeek::TYPE_INT )
+			val->val.int_val = i;
+		else if ( field->type == zeek::TYPE_COUNT )
+			val->val.uint_val = static_cast<uint64_t>(i);
+		else
+			{
+			val->val.port_val.port = static_cast<uint32_t>(i);
+			val->val.port_val.proto = TRANSPORT_UNKNOWN;
+			}
+		break;
+		}
+
+	case DECODER_FLOAT4:
+		{
+		uint32_t bits = ReadNetwork(data, 4);
+		float f;
+		memcpy(&f, &bits, sizeof(f));
+		val->val.double_val = f;
+		break;
+		}
+
+	case DECODER_FLOAT8:
+		{
+		uint64_t bits = ReadNetwork(data, 8);
+		memcpy(&val->val.double_val, &bits, sizeof(double));
+		break;
+		}
+
+	case DECODER_TIMESTAMP:
+		{
+		// microseconds since 2000-01-01; the extremes are -infinity and infinity
+		int64_t usec = static_cast<int64_t>(ReadNetwork(data, 8));
+		if ( usec == INT64_MIN || usec == INT64_MAX )
+			{
+			Error(Fmt("Invalid value for timestamp in %s", field->name));
+			return nullptr;
+			}
+
+		val->val.double_val = postgres_epoch + usec / 1e6;
+		break;
+		}
+
+	case DECODER_INTERVAL:
+		{
+		// microseconds, days, and months; converted like ParseInterval does
+		int64_t usec = static_cast<int64_t>(ReadNetwork(data, 8));
+		int32_t days = static_cast<int32_t>(ReadNetwork(data + 8, 4));
+		int32_t months = static_cast<int32_t>(ReadNetwork(data + 12, 4));
+
+		val->val.double_val = usec / 1e6 + days * 86400.0 + ( months / 12 ) * 365.25 * 86400 +
+			( months % 12 ) * 30 * 86400.0;
+		break;
+		}
+
+	case DECODER_INET:
+		{
+		// family, netmask bits, is_cidr, address length, address
+		if ( length < 4 || length != 4 + static_cast<uint8_t>(data[3]) ||
+		     ( data[3] != 4 && data[3] != 16 ) )
+			{
+			Error(Fmt("Invalid binary value for %s", field->name));
+			return nullptr;
+			}
+
+		Value::addr_t addr;
+		if ( data[3] == 4 )
+			{
+			addr.family = IPv4;
+			memcpy(&addr.in.in4, data + 4, 4);
+			}
+		else
+			{
+			addr.family = IPv6;
+			memcpy(&addr.in.in6, data + 4, 16);
+			}
+
+		if ( field->type == zeek::TYPE_ADDR )
+			val->val.addr_val = addr;
+		else
+			{
+			val->val.subnet_val.prefix = addr;
+			val->val.subnet_val.length = static_cast<uint8_t>(data[1]);
+			}
+		break;
+		}
+
+	default:
+		Error(Fmt("unsupported field format %d for %s", field->type, field->name));
+		return nullptr;
+	}
+
+	return val;
+	}
+
+// Converts an array in the binary format into a set or vector. Arrays with several dimensions
+// are flattened.
+std::unique_ptr<Value> PostgreSQL::BinaryArrayToVal(const char* data, int length, const Field* field, const Column& column)
+	{
+	const char* p = data;
+	const char* last = data + length;
+
+	// number of dimensions, flags, element type, then size and lower bound of each dimension
+	if ( last - p < 12 )
+		{
+		Error(Fmt("Invalid binary array for %s", field->name));
+		return nullptr;
+		}
+
+	int ndim = static_cast<int32_t>(ReadNetwork(p, 4));
+	p += 12;
+
+	if ( ndim < 0 || last - p < static_cast<int64_t>(ndim) * 8 )
+		{
+		Error(Fmt("Invalid binary array for %s", field->name));
+		return nullptr;
+		}
+
+	// every element takes at least the 4 bytes of its length, which bounds the size
+	// before anything is allocated for it
+	uint64_t max_size = ( last - p - ndim * 8 ) / 4;
+	uint64_t size = ndim > 0 ? 1 : 0;
+	for ( int i = 0; i < ndim; ++i, p += 8 )
+		{
+		uint64_t dim = static_cast<uint32_t>(ReadNetwork(p, 4));
+
+		if ( dim > 0 && size > max_size / dim )
+			{
+			Error(Fmt("Invalid binary array for %s", field->name));
+			return nullptr;
+			}
+
+		size *= dim;
+		}
+
+	std::vector<std::unique_ptr<Value>> vals;
+	vals.reserve(size);
+
+	for ( uint64_t i = 0; i < size; ++i )
+		{
+		if ( last - p < 4 )
+			{
+			Error(Fmt("Invalid binary array for %s", field->name));
+			return nullptr;
+			}
+
+		int32_t element_length = static_cast<int32_t>(ReadNetwork(p, 4));
+		p += 4;
+
+		if ( element_length < 0 )
+			{
+			// note that this actually leeds to problems at the moment downstream.
+			vals.emplace_back(new Value(field->subtype, false));
+			continue;
+			}
+
+		if ( last - p < element_length )
+			{
+			Error(Fmt("Invalid binary array for %s", field->name));
+			return nullptr;
+			}
+
+		auto element = BinaryToVal(p, element_length, column.element_field.get(), column.decoder, column.element_type);
+		if ( element == nullptr )
+			{
+			Error("Error while reading set");
+			return nullptr;
+			}
+
+		vals.push_back(std::move(element));
+		p += element_length;
+		}
+
+	std::unique_ptr<Value> val(new Value(field->type, true));
+
+	// this should not leak in case of error -- instead, Value::~Value will clean it up.
+	Value** lvals = new Value* [vals.size()];
+	for ( decltype(vals.size()) i = 0; i<vals.size(); ++i )
+		lvals[i] = vals[i].release();
+
+	if ( field->type == zeek::TYPE_TABLE )
+		{
+		val->val.set_val.vals = lvals;
+		val->val.set_val.size = vals.size();
+		}
+	else
+		{
+		val->val.vector_val.vals = lvals;
+		val->val.vector_val.size = vals.size();
+		}
+
+	return val;
+	}
+
+// sets the protocol of a port from its protocol column
+static void SetProto(Value* val, const std::string& proto)
+	{
+	if ( proto == "tcp" )
+		val->val.port_val.proto = TRANSPORT_TCP;
+	else if ( proto == "udp" )
+		val->val.port_val.proto = TRANSPORT_UDP;
+	else if ( proto == "icmp" )
+		val->val.port_val.proto = TRANSPORT_ICMP;
+	}
+
+// Sends all rows of a (partial) result to Zeek; with put, as single updates that are not part
+// of a complete update of the input.
+void PostgreSQL::SendRows(const PGresult* res, bool put)
+	{
+	for ( int i = 0; i < PQntuples(res); ++i )
+		{
+		std::vector<std::unique_ptr<Value>> ovals;
+		//ovals.resize(num_fields);
+
+		for ( int j = 0; j < num_fields; ++j )
+			{
+			const Column& column = columns[j];
+
+			if ( PQgetisnull(res, i, column.pos ) == 1 )
+				ovals.emplace_back(std::unique_ptr<Value>(new Value(fields[j]->type, false)));
+			else
+				{
+				// PQgetvalue result will be cleaned up by PQclear.
+				const char* data = PQgetvalue(res, i, column.pos);
+				int length = PQgetlength(res, i, column.pos);
+				std::unique_ptr<Value> val;
+
+				if ( ! binary_results )
+					val = EntryToVal(std::string(data, length), fields[j], column.type);
+				else if ( column.array )
+					val = BinaryArrayToVal(data, length, fields[j], column);
+				else
+					val = BinaryToVal(data, length, fields[j], column.decoder, column.type);
+
+				if ( val == nullptr )
+					{
+					// error occured, let's break out of this line. Just removing ovals will get rid of everything.
+					ovals.clear();
+					break;
+					}
+
+				if ( column.proto >= 0 && PQgetisnull(res, i, column.proto) == 0 )
+					SetProto(val.get(), PQgetvalue(res, i, column.proto));
+
+				ovals.push_back(std::move(val));
+				}
+			}
+
+		// if there is an result, send it on :)
+		if ( ! ovals.empty() )
+			{
+			assert( ovals.size() == num_fields );
+			Value** ofields = new Value*[num_fields];
+
+			for ( int i = 0; i < num_fields; ++i )
+				{
+				ofields[i] = ovals[i].release();
+				}
+
+			if ( put )
+				Put(ofields);
+			else
+				SendEntry(ofields);
+			}
+
+		// rows are ordered by the watermark, NULLs last
+		if ( watermark_pos >= 0 && PQgetisnull(res, i, watermark_pos) == 0 )
+			{
+			watermark.assign(PQgetvalue(res, i, watermark_pos), PQgetlength(res, i, watermark_pos));
+			watermark_binary = binary_results;
+			has_watermark = true;
+			}
+		}
+	}
+
+static bool IsRowResult(ExecStatusType status)
+	{
+#ifdef LIBPQ_HAS_CHUNK_MODE
+	if ( status == PGRES_TUPLES_CHUNK )
+		return true;
+#endif
+
+	return status == PGRES_TUPLES_OK || status == PGRES_SINGLE_TUPLE;
+	}
+
+// Runs the query and sends its rows to Zeek as they arrive, fetch_size rows at a time, so
+// that the whole result never has to be held in memory. With fetch_size 0, the complete
+// result is retrieved first.
+bool PostgreSQL::DoUpdate()
+	{
+	// the watermark is passed back in the format it was returned in
+	bool next = prepared && stream && has_watermark;
+	if ( ! SendQuery(next ? next_statement : read_statement, next ? &watermark : nullptr, watermark_binary) )
+		return false;
+
+	// Rows sent before a failure are kept; the update is not ended, as that would remove the
+	// entries of a table that were not sent.
+	bool replan = false;
+	if ( ! ReceiveRows(stream, &replan) )
+		{
+		if ( ! replan )
+			return false;
+
+		// the statements are prepared again once, see ReceiveRows
+		PGresult *res = PQexec(conn, "DEALLOCATE ALL;");
+		bool ok = PQresultStatus(res) == PGRES_COMMAND_OK;
+		PQclear(res);
+
+		if ( ! ok )
+			{
+			Error(Fmt("Could not deallocate prepared statements: %s", PQerrorMessage(conn)));
+			return false;
+			}
+
+		prepared = false;
+		if ( ! Prepare() )
+			return false;
+
+		next = prepared && stream && has_watermark;
+		if ( ! SendQuery(next ? next_statement : read_statement, next ? &watermark : nullptr, watermark_binary) ||
+		     ! ReceiveRows(stream, nullptr) )
+			return false;
+		}
+
+	if ( ! stream )
+		EndCurrentSend();
+
+	return true;
+	}
+
+// Sends the given prepared statement with the parameters of the query, and extra as the last
+// parameter, if it is set; in the binary format with extra_binary. Unprepared queries are sent as
+// they are.
+bool PostgreSQL::SendQuery(const char* statement, const std::string* extra, bool extra_binary)
+	{
+	std::vector<const char*> values;
+	std::vector<int> lengths;
+	std::vector<int> formats;
+
+	for ( const auto& param : params )
+		{
+		values.push_back(param.c_str());
+		lengths.push_back(param.size());
+		formats.push_back(0);
+		}
+
+	if ( extra )
+		{
+		values.push_back(extra->c_str());
+		lengths.push_back(extra->size());
+		formats.push_back(extra_binary ? 1 : 0);
+		}
+
+	int sent;
+	if ( prepared )
+		sent = PQsendQueryPrepared(conn, statement, values.size(), values.data(), lengths.data(), formats.data(),
+					   binary_results ? 1 : 0);
+	else
+		sent = PQsendQueryParams(conn, query.c_str(), values.size(), NULL, values.data(), lengths.data(),
+					 formats.data(), 0);
+
+	if ( sent != 1 )
+		{
+		Error(Fmt("PostgreSQL query failed: %s", PQerrorMessage(conn)));
+		return false;
+		}
+
+	return true;
+	}
+
+// runs the query for the rows with the given key, and sends them as single updates
+bool PostgreSQL::UpdateKey(const std::string& key)
+	{
+	return SendQuery(key_statement, &key, false) && ReceiveRows(true, nullptr);
+	}
+
+// Retrieves the result of the query that was sent, and sends its rows to Zeek, see SendRows.
+// Returns false if the query failed. If replan is given, it is set instead of reporting the
+// error if a prepared statement failed because the result columns of the query changed, and
+// no rows were sent yet.
+bool PostgreSQL::ReceiveRows(bool put, bool* replan)
+	{
+	if ( fetch_size > 0 )
+		{
+		// chunked mode needs libpq 17; single-row mode is the fallback
+#ifdef LIBPQ_HAS_CHUNK_MODE
+		int chunk = static_cast<int>(std::min<uint64_t>(fetch_size, INT_MAX));
+		bool streaming = chunk > 1 ? PQsetChunkedRowsMode(conn, chunk) == 1 : PQsetSingleRowMode(conn) == 1;
+#else
+		bool streaming = PQsetSingleRowMode(conn) == 1;
+#endif
+		if ( ! streaming )
+			Warning("Could not switch to single-row mode, retrieving the whole result");
+		}
+
+	bool ok = true;
+	bool mapped = prepared;
+	bool sent = false;
+
+	// PQgetResult returns one result per chunk, then a final result without rows, and finally
+	// nullptr. It has to be called until it returns nullptr, even after an error.
+	while ( PGresult *res = PQgetResult(conn) )
+		{
+		ExecStatusType status = PQresultStatus(res);
+
+		if ( ok && ! IsRowResult(status) )
+			{
+			// "cached plan must not change result type"
+			const char* sqlstate = PQresultErrorField(res, PG_DIAG_SQLSTATE);
+			if ( replan && prepared && ! sent && sqlstate && strcmp(sqlstate, "0A000") == 0 )
+				*replan = true;
+			else
+				Error(Fmt("PostgreSQL query failed: %s", PQresultErrorMessage(res)));
+
+			ok = false;
+			}
+
+		// the columns of unprepared queries are only mapped again if the result changed
+		if ( ok && ! mapped && ! SameShape(res) )
+			{
+			ok = MapColumns(res);
+			SetShape(ok ? res : nullptr);
+			}
+
+		mapped = true;
+
+		if ( ok )
+			{
+			SendRows(res, put);
+			sent = sent || PQntuples(res) > 0;
+			}
+
+		PQclear(res);
+		}
+
+	return ok;
+	}
+
+// Checks for notifications on notify_channel without blocking, and updates the input if
+// there were any. Notifications with a payload only update the rows with that key, if
+// notify_key_column is set.
+void PostgreSQL::CheckNotifications()
+	{
+	bool update = false;
+
+	if ( PQstatus(conn) == CONNECTION_BAD )
+		{
+		if ( ! Reconnect() )
+			return;
+
+		// notifications sent while we were disconnected are lost
+		update = true;
+		}
+
+	else if ( PQconsumeInput(conn) != 1 )
+		{
+		Warning(Fmt("Could not check for notifications: %s", PQerrorMessage(conn)));
+		return;
+		}
+
+	std::set<std::string> keys;
+
+	while ( PGnotify* notify = PQnotifies(conn) )
+		{
+		if ( key_query.empty() || notify->extra[0] == '\0' )
+			update = true;
+		else
+			keys.insert(notify->extra);
+
+		PQfreemem(notify);
+		}
+
+	if ( update )
+		{
+		DoUpdate();
+		return;
+		}
+
+	for ( const auto& key : keys )
+		{
+		if ( ! UpdateKey(key) )
+			return;
+		}
+	}
+
+// Checks that the replica identity of the replicated table consists of fields. Updates and
+// deletes only carry the old values of these columns, which are needed to remove the old
+// entry; with REPLICA IDENTITY FULL, they carry the whole old row.
+bool PostgreSQL::CheckReplicaIdentity(const std::string& schema, const std::string& relation)
+	{
+	const char* values[] = { schema.c_str(), relation.c_str() };
+	PGresult *res = PQexecParams(conn, "SELECT c.relreplident, a.attname FROM pg_class c "
+			"LEFT JOIN pg_index i ON i.indrelid = c.oid AND CASE c.relreplident WHEN 'd' THEN i.indisprimary "
+			"WHEN 'i' THEN i.indisreplident ELSE false END "
+			"LEFT JOIN pg_attribute a ON a.attrelid = c.oid AND a.attnum = ANY(i.indkey) "
+			"WHERE c.relnamespace = $1::regnamespace AND c.relname = $2;", 2, NULL, values, NULL, NULL, 0);
+
+	if ( PQresultStatus(res) != PGRES_TUPLES_OK || PQntuples(res) == 0 )
+		{
+		Error(Fmt("Could not look up replica identity of %s.%s: %s", schema.c_str(), relation.c_str(),
+			  PQresultStatus(res) == PGRES_TUPLES_OK ? "table not found" : PQerrorMessage(conn)));
+		PQclear(res);
+		return false;
+		}
+
+	bool ok = true;
+
+	if ( strcmp(PQgetvalue(res, 0, 0), "f") != 0 )
+		{
+		if ( PQgetisnull(res, 0, 1) )
+			{
+			Error(Fmt("%s.%s has no replica identity; its updates and deletes cannot be replicated",
+				  schema.c_str(), relation.c_str()));
+			ok = false;
+			}
+
+		for ( int i = 0; ok && i < PQntuples(res); ++i )
+			{
+			const char* name = PQgetvalue(res, i, 1);
+			bool found = false;
+
+			for ( int j = 0; j < num_fields; ++j )
+				found = found || strcmp(fields[j]->name, name) == 0;
+
+			if ( ! found )
+				{
+				Error(Fmt("Column %s of the replica identity of %s.%s is not a field", name,
+					  schema.c_str(), relation.c_str()));
+				ok = false;
+				}
+			}
+		}
+
+	PQclear(res);
+	return ok;
+	}
+
+// Creates the replication slot, loads the query in its snapshot, and starts streaming the
+// changes made after that.
+bool PostgreSQL::StartReplication()
+	{
+	std::string snapshot;
+	if ( ! replication->Open(snapshot) )
+		{
+		Error(replication->LastError().c_str());
+		return false;
+		}
+
+	char* escaped = PQescapeLiteral(conn, snapshot.c_str(), snapshot.size());
+	if ( escaped == nullptr )
+		{
+		Error(Fmt("Error while escaping snapshot name: %s", PQerrorMessage(conn)));
+		return false;
+		}
+
+	std::string begin = std::string("BEGIN ISOLATION LEVEL REPEATABLE READ; SET TRANSACTION SNAPSHOT ") + escaped + ";";
+	PQfreemem(escaped);
+
+	PGresult *res = PQexec(conn, begin.c_str());
+	bool ok = PQresultStatus(res) == PGRES_COMMAND_OK;
+	PQclear(res);
+
+	if ( ! ok )
+		Error(Fmt("Could not use snapshot of replication slot: %s", PQerrorMessage(conn)));
+
+	ok = ok && DoUpdate();
+
+	res = PQexec(conn, ok ? "COMMIT;" : "ROLLBACK;");
+	PQclear(res);
+
+	if ( ! ok )
+		return false;
+
+	if ( ! replication->Start() )
+		{
+		Error(replication->LastError().c_str());
+		return false;
+		}
+
+	return true;
+	}
+
+// Converts a row of a replicated change into the values of the fields. Returns nullptr if
+// the row cannot be converted.
+Value** PostgreSQL::ChangeToVals(const ReplicationStream::Change& change, const std::vector<ReplicationStream::Datum>& row)
+	{
+	std::vector<std::unique_ptr<Value>> ovals;
+
+	for ( int j = 0; j < num_fields; ++j )
+		{
+		const Column& column = replication_columns[j];
+		const ReplicationStream::Datum* datum = &row[column.pos];
+
+		// unchanged TOASTed values of updates are only sent in the old row, with REPLICA
+		// IDENTITY FULL
+		if ( datum->unchanged && ! change.old_key_only && column.pos < static_cast<int>(change.old_row.size()) )
+			datum = &change.old_row[column.pos];
+
+		if ( datum->unchanged )
+			{
+			Warning(Fmt("Value of %s was not replicated, skipping change", fields[j]->name));
+			return nullptr;
+			}
+
+		if ( datum->null )
+			{
+			ovals.emplace_back(new Value(fields[j]->type, false));
+			continue;
+			}
+
+		auto val = EntryToVal(datum->value, fields[j], column.type);
+		if ( val == nullptr )
+			return nullptr;
+
+		if ( column.proto >= 0 && ! row[column.proto].null && ! row[column.proto].unchanged )
+			SetProto(val.get(), row[column.proto].value);
+
+		ovals.push_back(std::move(val));
+		}
+
+	Value** ofields = new Value*[num_fields];
+	for ( int i = 0; i < num_fields; ++i )
+		ofields[i] = ovals[i].release();
+
+	return ofields;
+	}
+
+// maps the fields to the columns of the replicated table; returns false if one is missing
+bool PostgreSQL::MapReplicationColumns(const std::vector<ReplicationStream::Column>& relation)
+	{
+	replication_columns.clear();
+
+	for ( int i = 0; i < num_fields; ++i )
+		{
+		Column column;
+		column.pos = -1;
+		column.proto = -1;
+		column.type = 0;
+		column.decoder = DECODER_TEXT;
+		column.array = false;
+		column.element_type = 0;
+
+		std::string proto = std::string(fields[i]->name) + "_proto";
+
+		for ( size_t j = 0; j < relation.size(); ++j )
+			{
+			if ( relation[j].name == fields[i]->name )
+				{
+				column.pos = j;
+				column.type = relation[j].type;
+				}
+
+			if ( fields[i]->type == zeek::TYPE_PORT && relation[j].name == proto )
+				column.proto = j;
+			}
+
+		if ( column.pos < 0 )
+			{
+			Error(Fmt("Field %s was not found in replicated table", fields[i]->name));
+			return false;
+			}
+
+		replication_columns.push_back(std::move(column));
+		}
+
+	return true;
+	}
+
+// applies the changes streamed from the replication slot to the input
+void PostgreSQL::ApplyChanges(const std::vector<ReplicationStream::Change>& changes)
+	{
+	for ( const auto& change : changes )
+		{
+		if ( change.type == ReplicationStream::CHANGE_TRUNCATE )
+			{
+			Clear();
+			continue;
+			}
+
+		if ( change.columns != replication_relation )
+			{
+			replication_relation = change.columns;
+			replication_mapped = MapReplicationColumns(*change.columns);
+			}
+
+		if ( ! replication_mapped )
+			continue;
+
+		// The old row is only sent for updates if the key changed, or with REPLICA IDENTITY
+		// FULL. In the latter case, the entry is updated in place.
+		bool remove = change.type == ReplicationStream::CHANGE_DELETE ||
+			( change.type == ReplicationStream::CHANGE_UPDATE && change.old_key_only );
+
+		if ( remove && change.old_row.size() == change.columns->size() )
+			{
+			if ( Value** vals = ChangeToVals(change, change.old_row) )
+				Delete(vals);
+			}
+
+		if ( change.type != ReplicationStream::CHANGE_DELETE && change.new_row.size() == change.columns->size() )
+			{
+			if ( Value** vals = ChangeToVals(change, change.new_row) )
+				Put(vals);
+			}
+		}
+	}
+
+// Updates the input when notifications arrive on notify_channel; in MODE_STREAM without
+// notify_channel, polls for new rows every poll_interval seconds. Errors are reported, but
+// do not stop polling; a lost connection is re-established on the next poll.
+bool PostgreSQL::DoHeartbeat(double network_time, double current_time)
+	{
+	if ( replication )
+		{
+		// a failed stream is started again with a new slot and a complete reload
+		if ( ! replication->Active() )
+			{
+			if ( PQstatus(conn) == CONNECTION_BAD && ! Reconnect() )
+				return true;
+
+			StartReplication();
+			return true;
+			}
+
+		std::vector<ReplicationStream::Change> changes;
+		bool ok = replication->Poll(changes);
+		ApplyChanges(changes);
+
+		if ( ok )
+			ok = replication->SendStatus();
+
+		if ( ! ok )
+			Warning(replication->LastError().c_str());
+
+		return true;
+		}
+
+	if ( ! notify_channel.empty() )
+		{
+		CheckNotifications();
+		return true;
+		}
+
+	if ( ! stream || current_time < next_poll )
+		return true;
+
+	next_poll = current_time + poll_interval;
+
+	if ( PQstatus(conn) == CONNECTION_BAD && ! Reconnect() )
+		return true;
+
+	DoUpdate();
+
 	return true;
 	}
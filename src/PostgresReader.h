@@ -11,6 +11,8 @@
 #include "zeek/threading/formatters/Ascii.h"
 #include <libpq-fe.h>
 
+#include "PostgresReplication.h"
+
 namespace input { namespace reader {
 
 class PostgreSQL : public zeek::input::ReaderBackend {
@@ -38,14 +40,102 @@ private:
 	// note - EscapeIdentifier is replicated in writier
 	std::string EscapeIdentifier(const char* identifier);
 	std::string LookupParam(const ReaderInfo& info, const std::string name) const;
-	std::unique_ptr<zeek::threading::Value> EntryToVal(std::string s, const zeek::threading::Field* type);
+	bool LookupCountParam(const ReaderInfo& info, const std::string name, uint64_t& value);
+	bool Prepare();
+	bool SetupSession();
+	bool Reconnect();
+	bool MapColumns(const PGresult* res);
+	bool SendQuery(const char* statement, const std::string* extra, bool extra_binary);
+	bool ReceiveRows(bool put, bool* replan);
+	void SetShape(const PGresult* res);
+	bool SameShape(const PGresult* res) const;
+	void SendRows(const PGresult* res, bool put);
+	bool UpdateKey(const std::string& key);
+	void CheckNotifications();
+	bool CheckReplicaIdentity(const std::string& schema, const std::string& relation);
+	bool StartReplication();
+	bool MapReplicationColumns(const std::vector<ReplicationStream::Column>& relation);
+	zeek::threading::Value** ChangeToVals(const ReplicationStream::Change& change,
+					      const std::vector<ReplicationStream::Datum>& row);
+	void ApplyChanges(const std::vector<ReplicationStream::Change>& changes);
+	std::unique_ptr<zeek::threading::Value> EntryToVal(std::string s, const zeek::threading::Field* type, Oid column_type);
+	bool ParseTimestamp(const std::string& s, double* time);
+	bool ParseInterval(const std::string& s, double* interval);
+
+	// how the values of a result column are converted; everything but DECODER_TEXT reads the
+	// binary format
+	enum Decoder {
+		DECODER_NONE, // no conversion for the field type; the query has to use text results
+		DECODER_TEXT, // text and text-like types, parsed with EntryToVal
+		DECODER_BOOL,
+		DECODER_INT2,
+		DECODER_INT4,
+		DECODER_INT8,
+		DECODER_FLOAT4,
+		DECODER_FLOAT8,
+		DECODER_TIMESTAMP,
+		DECODER_INTERVAL,
+		DECODER_INET,
+	};
+
+	// the result column of a field
+	struct Column {
+		int pos;
+		int proto; // column of the protocol of a port; -1 if there is none
+		Oid type;
+		Decoder decoder; // of the elements, for arrays
+		bool array;
+		Oid element_type;
+		std::unique_ptr<zeek::threading::Field> element_field;
+	};
+
+	Decoder ResolveDecoder(zeek::TypeTag type, Oid column_type);
+	std::unique_ptr<zeek::threading::Value> BinaryToVal(const char* data, int length, const zeek::threading::Field* field,
+							     Decoder decoder, Oid column_type);
+	std::unique_ptr<zeek::threading::Value> BinaryArrayToVal(const char* data, int length, const zeek::threading::Field* field,
+								  const Column& column);
 
 	PGconn *conn;
 	std::unique_ptr<zeek::threading::formatter::Ascii> io;
 
 	const zeek::threading::Field* const * fields; // raw mapping
 	std::string query;
+	std::vector<std::string> params; // values of $1, $2, ...
+	uint64_t fetch_size; // rows retrieved at a time; 0 for the whole result
+
+	// MODE_STREAM: the query is polled for rows with a greater watermark than the last one
+	bool stream;
+	std::string watermark_column; // escaped
+	std::string next_query;
+	int watermark_pos; // result column of the watermark
+	bool has_watermark;
+	bool watermark_binary; // format of the watermark
+	std::string watermark; // in the format of the results
+	uint64_t poll_interval; // seconds
+	double next_poll;
+
+	// updates are triggered by notifications on this channel (escaped), if it is set
+	std::string notify_channel;
+	std::string key_query; // selects the rows with the key given in a notification
+
+	// changes of the table streamed from a logical replication slot, if publication is set
+	std::unique_ptr<ReplicationStream> replication;
+	std::shared_ptr<const std::vector<ReplicationStream::Column>> replication_relation; // columns were mapped for
+	std::vector<Column> replication_columns; // column of each field in the rows of changes
+	bool replication_mapped;
+	std::string replication_schema;
+	std::string replication_table;
 	int num_fields;
+
+	// Set if the query could be prepared. Its columns are mapped once; if all of them can be
+	// decoded from the binary format, it is retrieved in binary.
+	bool prepared;
+	bool binary_results;
+	std::vector<Column> columns;
+
+	// names and types of the result columns the unprepared query was mapped for
+	std::vector<std::pair<std::string, Oid>> shape;
+	bool has_shape;
 };
 
 
@@ -0,0 +1,419 @@
+// See the file "COPYING" in the main distribution directory for copyright.
+
+#include <chrono>
+#include <cinttypes>
+#include <cstdio>
+#include <cstring>
+
+#include "PostgresReplication.h"
+
+using namespace input::reader;
+
+// Messages of the streaming replication protocol are sent in CopyData messages; the logical
+// decoding output is wrapped in XLogData messages. All integers are in network byte order.
+// See "Streaming Replication Protocol" and "Logical Streaming Replication Protocol" in the
+// PostgreSQL documentation.
+
+// microseconds between the unix epoch and the PostgreSQL epoch, 2000-01-01
+static const int64_t postgres_epoch_usec = 946684800LL * 1000000;
+
+static uint64_t ReadUint(const char* data, int bytes)
+	{
+	uint64_t val = 0;
+	for ( int i = 0; i < bytes; ++i )
+		val = (val << 8) | static_cast<uint8_t>(data[i]);
+	return val;
+	}
+
+static void AppendUint(std::string& out, uint64_t val, int bytes)
+	{
+	for ( int i = bytes - 1; i >= 0; --i )
+		out += static_cast<char>((val >> (i * 8)) & 0xff);
+	}
+
+// reads a null-terminated string; returns false if it is not terminated before last
+static bool ReadString(const char*& p, const char* last, std::string& out)
+	{
+	const char* end = static_cast<const char*>(memchr(p, '\0', last - p));
+	if ( end == nullptr )
+		return false;
+
+	out.assign(p, end - p);
+	p = end + 1;
+	return true;
+	}
+
+// parses an LSN in the text format, e.g. 0/16B3748
+static bool ParseLsn(const char* s, uint64_t& lsn)
+	{
+	unsigned int high, low;
+	if ( sscanf(s, "%X/%X", &high, &low) != 2 )
+		return false;
+
+	lsn = (static_cast<uint64_t>(high) << 32) | low;
+	return true;
+	}
+
+// quotes a string as literal of a replication command
+static std::string Quote(const std::string& s)
+	{
+	std::string out = "'";
+	for ( char c : s )
+		{
+		if ( c == '\'' )
+			out += '\'';
+		out += c;
+		}
+	return out + "'";
+	}
+
+// quotes a string as identifier of a replication command
+static std::string QuoteIdentifier(const std::string& s)
+	{
+	std::string out = "\"";
+	for ( char c : s )
+		{
+		if ( c == '"' )
+			out += '"';
+		out += c;
+		}
+	return out + "\"";
+	}
+
+ReplicationStream::ReplicationStream(const std::string& arg_conninfo, const std::string& arg_slot,
+				     const std::string& arg_publication, const std::string& arg_schema,
+				     const std::string& arg_table)
+	: conninfo(arg_conninfo), slot(arg_slot), publication(arg_publication), schema(arg_schema), table(arg_table)
+	{
+	conn = nullptr;
+	streaming = false;
+	start_lsn = 0;
+	applied_lsn = 0;
+	in_transaction = false;
+	relation_id = 0;
+	}
+
+ReplicationStream::~ReplicationStream()
+	{
+	if ( conn )
+		PQfinish(conn);
+	}
+
+bool ReplicationStream::Fail(const std::string& msg)
+	{
+	error = msg;
+	streaming = false;
+	return false;
+	}
+
+bool ReplicationStream::Open(std::string& snapshot)
+	{
+	// closing the connection drops the temporary slot of an earlier stream
+	if ( conn )
+		PQfinish(conn);
+
+	streaming = false;
+	in_transaction = false;
+	relation_id = 0;
+	columns.reset();
+
+	// Conninfo may be a connection string or URI; the replication parameter is added to it.
+	// pgoutput sends values in the text format of the session, which the reader parses.
+	const char* keywords[] = { "dbname", "replication", "options", nullptr };
+	const char* values[] = { conninfo.c_str(), "database",
+				 "-c DateStyle=ISO -c TimeZone=UTC -c IntervalStyle=postgres", nullptr };
+	conn = PQconnectdbParams(keywords, values, 1);
+
+	if ( PQstatus(conn) != CONNECTION_OK )
+		return Fail(std::string("Could not open replication connection: ") + PQerrorMessage(conn));
+
+	std::string create = "CREATE_REPLICATION_SLOT " + QuoteIdentifier(slot) + " TEMPORARY LOGICAL pgoutput EXPORT_SNAPSHOT";
+	PGresult *res = PQexec(conn, create.c_str());
+
+	if ( PQresultStatus(res) != PGRES_TUPLES_OK || PQntuples(res) != 1 || PQnfields(res) < 3 )
+		{
+		PQclear(res);
+		return Fail(std::string("Could not create replication slot: ") + PQerrorMessage(conn));
+		}
+
+	// slot_name, consistent_point, snapshot_name, output_plugin
+	bool ok = ParseLsn(PQgetvalue(res, 0, 1), start_lsn);
+	snapshot = PQgetvalue(res, 0, 2);
+	PQclear(res);
+
+	if ( ! ok )
+		return Fail("Invalid consistent point of replication slot");
+
+	applied_lsn = start_lsn;
+	return true;
+	}
+
+bool ReplicationStream::Start()
+	{
+	char lsn[32];
+	snprintf(lsn, sizeof(lsn), "%X/%X", static_cast<unsigned int>(start_lsn >> 32), static_cast<unsigned int>(start_lsn));
+
+	std::string start = "START_REPLICATION SLOT " + QuoteIdentifier(slot) + " LOGICAL " + lsn +
+		" (proto_version '1', publication_names " + Quote(QuoteIdentifier(publication)) + ")";
+
+	PGresult *res = PQexec(conn, start.c_str());
+	bool ok = PQresultStatus(res) == PGRES_COPY_BOTH;
+	PQclear(res);
+
+	if ( ! ok )
+		return Fail(std::string("Could not start replication: ") + PQerrorMessage(conn));
+
+	streaming = true;
+	return true;
+	}
+
+bool ReplicationStream::Poll(std::vector<Change>& changes)
+	{
+	if ( ! streaming )
+		return false;
+
+	if ( PQconsumeInput(conn) != 1 )
+		return Fail(std::string("Replication connection failed: ") + PQerrorMessage(conn));
+
+	for ( ;; )
+		{
+		char* buf = nullptr;
+		int length = PQgetCopyData(conn, &buf, 1);
+
+		if ( length == 0 )
+			return true; // no complete message yet
+
+		if ( length < 0 )
+			{
+			std::string msg = length == -1 ? "Replication stream ended" : std::string("Replication stream failed: ") + PQerrorMessage(conn);
+			PGresult *res = PQgetResult(conn);
+			if ( res && PQresultStatus(res) == PGRES_FATAL_ERROR )
+				msg = std::string("Replication stream failed: ") + PQresultErrorMessage(res);
+			PQclear(res);
+			return Fail(msg);
+			}
+
+		bool ok = true;
+
+		if ( buf[0] == 'w' && length >= 25 )
+			// XLogData: start of the data, end of the WAL, send time, data
+			ok = HandleMessage(buf + 25, length - 25, changes);
+
+		else if ( buf[0] == 'k' && length >= 18 )
+			{
+			// Keepalive: end of the WAL, send time, reply requested. Outside of a
+			// transaction, everything up to the end of the WAL was seen.
+			if ( ! in_transaction )
+				{
+				uint64_t wal_end = ReadUint(buf + 1, 8);
+				if ( wal_end > applied_lsn )
+					applied_lsn = wal_end;
+				}
+
+			if ( buf[17] )
+				ok = SendStatus();
+			}
+
+		PQfreemem(buf);
+
+		if ( ! ok )
+			return false;
+		}
+	}
+
+// handles a pgoutput message
+bool ReplicationStream::HandleMessage(const char* data, size_t length, std::vector<Change>& changes)
+	{
+	if ( length == 0 )
+		return true;
+
+	const char* p = data + 1;
+	const char* last = data + length;
+
+	switch ( data[0] ) {
+	case 'B': // begin
+		in_transaction = true;
+		return true;
+
+	case 'C': // commit: flags, commit LSN, end LSN, commit time
+		if ( last - p < 17 )
+			return Fail("Invalid commit message");
+
+		applied_lsn = ReadUint(p + 9, 8);
+		in_transaction = false;
+		return true;
+
+	case 'R': // relation
+		{
+		if ( last - p < 4 )
+			return Fail("Invalid relation message");
+
+		uint32_t id = ReadUint(p, 4);
+		p += 4;
+
+		std::string nspname, relname;
+		if ( ! ReadString(p, last, nspname) || ! ReadString(p, last, relname) || last - p < 3 )
+			return Fail("Invalid relation message");
+
+		// an empty namespace is pg_catalog
+		if ( relname != table || nspname != schema )
+			return true;
+
+		// replica identity, number of columns, then flags, name, type, and modifier of each
+		int ncolumns = ReadUint(p + 1, 2);
+		p += 3;
+
+		auto relation = std::make_shared<std::vector<Column>>();
+
+		for ( int i = 0; i < ncolumns; ++i )
+			{
+			Column column;
+
+			if ( last - p < 1 )
+				return Fail("Invalid relation message");
+
+			++p;
+
+			if ( ! ReadString(p, last, column.name) || last - p < 8 )
+				return Fail("Invalid relation message");
+
+			column.type = ReadUint(p, 4);
+			p += 8;
+			relation->push_back(column);
+			}
+
+		relation_id = id;
+		columns = relation;
+		return true;
+		}
+
+	case 'I': // insert
+	case 'U': // update
+	case 'D': // delete
+		{
+		if ( last - p < 5 )
+			return Fail("Invalid change message");
+
+		if ( relation_id == 0 || ReadUint(p, 4) != relation_id )
+			return true;
+
+		p += 4;
+
+		Change change;
+		change.type = data[0] == 'I' ? CHANGE_INSERT : data[0] == 'U' ? CHANGE_UPDATE : CHANGE_DELETE;
+		change.columns = columns;
+		change.old_key_only = false;
+
+		if ( *p == 'K' || *p == 'O' )
+			{
+			change.old_key_only = *p == 'K';
+			++p;
+
+			if ( ! ReadTuple(p, last, change.old_row) )
+				return Fail("Invalid change message");
+			}
+
+		if ( change.type != CHANGE_DELETE )
+			{
+			if ( last - p < 1 || *p != 'N' )
+				return Fail("Invalid change message");
+
+			++p;
+
+			if ( ! ReadTuple(p, last, change.new_row) )
+				return Fail("Invalid change message");
+			}
+
+		changes.push_back(std::move(change));
+		return true;
+		}
+
+	case 'T': // truncate: number of relations, options, relation ids
+		{
+		if ( last - p < 5 )
+			return Fail("Invalid truncate message");
+
+		uint32_t nrelations = ReadUint(p, 4);
+		p += 5;
+
+		for ( uint32_t i = 0; i < nrelations && last - p >= 4; ++i, p += 4 )
+			{
+			if ( relation_id != 0 && ReadUint(p, 4) == relation_id )
+				{
+				Change change;
+				change.type = CHANGE_TRUNCATE;
+				change.columns = columns;
+				change.old_key_only = false;
+				changes.push_back(std::move(change));
+				}
+			}
+
+		return true;
+		}
+
+	default: // origin, type, and logical decoding messages
+		return true;
+	}
+	}
+
+// reads TupleData: number of columns, then for each a kind and, for text values, the value
+bool ReplicationStream::ReadTuple(const char*& p, const char* last, std::vector<Datum>& row)
+	{
+	if ( last - p < 2 )
+		return false;
+
+	int ncolumns = ReadUint(p, 2);
+	p += 2;
+
+	row.resize(ncolumns);
+
+	for ( Datum& datum : row )
+		{
+		if ( last - p < 1 )
+			return false;
+
+		char kind = *p++;
+		datum.null = kind == 'n';
+		datum.unchanged = kind == 'u';
+		datum.value.clear();
+
+		if ( kind != 't' && kind != 'b' )
+			continue;
+
+		if ( last - p < 4 )
+			return false;
+
+		uint32_t length = ReadUint(p, 4);
+		p += 4;
+
+		if ( static_cast<uint64_t>(last - p) < length )
+			return false;
+
+		datum.value.assign(p, length);
+		p += length;
+		}
+
+	return true;
+	}
+
+bool ReplicationStream::SendStatus()
+	{
+	if ( ! streaming )
+		return false;
+
+	int64_t now = std::chrono::duration_cast<std::chrono::microseconds>(
+		std::chrono::system_clock::now().time_since_epoch()).count() - postgres_epoch_usec;
+
+	// standby status update: written, flushed, and applied LSN, time, reply requested
+	std::string status = "r";
+	AppendUint(status, applied_lsn, 8);
+	AppendUint(status, applied_lsn, 8);
+	AppendUint(status, applied_lsn, 8);
+	AppendUint(status, static_cast<uint64_t>(now), 8);
+	status += '\0';
+
+	if ( PQputCopyData(conn, status.data(), status.size()) != 1 || PQflush(conn) != 0 )
+		return Fail(std::string("Could not send replication status: ") + PQerrorMessage(conn));
+
+	return true;
+	}
@@ -0,0 +1,103 @@
+// See the file "COPYING" in the main distribution directory for copyright.
+//
+// Consumer of a logical replication slot that decodes the pgoutput change stream of a table.
+
+#ifndef INPUT_READERS_POSTGRES_REPLICATION_H
+#define INPUT_READERS_POSTGRES_REPLICATION_H
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "libpq-fe.h"
+
+namespace input { namespace reader {
+
+// Streams the changes of one table from a temporary logical replication slot with the
+// pgoutput plugin. The slot lives as long as the replication connection; the table has to
+// be loaded in the snapshot exported when the slot is created, so that no change is missed
+// or applied twice. Changes of other tables of the publication are skipped.
+class ReplicationStream {
+public:
+	// a column of the table, as sent in the relation message
+	struct Column {
+		std::string name;
+		Oid type;
+	};
+
+	// a column value of a changed row, in the text format
+	struct Datum {
+		bool null;
+		bool unchanged; // TOASTed value that did not change and was not sent
+		std::string value;
+	};
+
+	enum ChangeType { CHANGE_INSERT, CHANGE_UPDATE, CHANGE_DELETE, CHANGE_TRUNCATE };
+
+	struct Change {
+		ChangeType type;
+		// columns of the table at the time of the change; rows are in this order
+		std::shared_ptr<const std::vector<Column>> columns;
+		// Old row of updates and deletes: only the replica identity columns, or the whole
+		// row with REPLICA IDENTITY FULL. Updates only carry it if the key changed or with
+		// REPLICA IDENTITY FULL.
+		std::vector<Datum> old_row;
+		bool old_key_only;
+		std::vector<Datum> new_row; // inserts and updates
+	};
+
+	ReplicationStream(const std::string& conninfo, const std::string& slot, const std::string& publication,
+			  const std::string& schema, const std::string& table);
+	~ReplicationStream();
+
+	// prohibit copying and moving
+	ReplicationStream(const ReplicationStream&) = delete;
+	ReplicationStream& operator=(const ReplicationStream&) = delete;
+
+	// (Re)connects and creates the slot. Sets snapshot to the name of the exported snapshot,
+	// which stays valid until Start is called.
+	bool Open(std::string& snapshot);
+
+	// starts streaming the changes after the creation of the slot
+	bool Start();
+
+	bool Active() const	{ return streaming; }
+
+	// Reads the messages that arrived, without blocking, and appends the changes of the table
+	// to changes. Returns false if the stream failed; it has to be opened again then.
+	bool Poll(std::vector<Change>& changes);
+
+	// Confirms that all changes returned by Poll were applied, so that the server can
+	// discard the WAL they are in. Called regularly.
+	bool SendStatus();
+
+	const std::string& LastError() const	{ return error; }
+
+private:
+	bool Fail(const std::string& msg);
+	bool HandleMessage(const char* data, size_t length, std::vector<Change>& changes);
+	bool ReadTuple(const char*& p, const char* last, std::vector<Datum>& row);
+
+	std::string conninfo;
+	std::string slot;
+	std::string publication;
+	std::string schema;
+	std::string table;
+
+	PGconn* conn;
+	bool streaming;
+	std::string error;
+
+	uint64_t start_lsn; // consistent point of the slot
+	uint64_t applied_lsn; // end of the last transaction returned by Poll
+	bool in_transaction;
+
+	uint32_t relation_id; // of the table; 0 until its relation message was received
+	std::shared_ptr<const std::vector<Column>> columns;
+};
+
+}
+}
+
+#endif /* INPUT_READERS_POSTGRES_REPLICATION_H */
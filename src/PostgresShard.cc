@@ -0,0 +1,349 @@
+// See the file "COPYING" in the main distribution directory for copyright.
+
+#include "PostgresShard.h"
+
+using namespace logging::writer;
+
+ShardWorker::ShardWorker(const std::string& arg_conninfo, const std::string& arg_statement, const std::string& arg_insert,
+			 const std::vector<Oid>& arg_param_types, const std::string& arg_synchronous_commit, uint64_t arg_max_queued)
+	: conninfo(arg_conninfo), statement(arg_statement), insert(arg_insert), param_types(arg_param_types),
+	  synchronous_commit(arg_synchronous_commit), max_queued(arg_max_queued > 0 ? arg_max_queued : 1)
+	{
+	nparams = param_types.size();
+	conn = nullptr;
+	busy = false;
+	stop = false;
+	has_errors = false;
+	written_rows = 0;
+	written_bytes = 0;
+	}
+
+ShardWorker::~ShardWorker()
+	{
+	if ( thread.joinable() )
+		{
+			{
+			std::lock_guard<std::mutex> lock(mutex);
+			stop = true;
+			}
+
+		changed.notify_all();
+		thread.join();
+		}
+
+	if ( conn )
+		PQfinish(conn);
+	}
+
+// (re)connects, and sets up the session like the writer does for its own connection
+bool ShardWorker::Connect(std::string& error)
+	{
+	if ( conn == nullptr )
+		conn = PQconnectdb(conninfo.c_str());
+	else
+		PQreset(conn);
+
+	if ( PQstatus(conn) != CONNECTION_OK )
+		{
+		error = std::string("Could not connect to pg: ") + PQerrorMessage(conn);
+		return false;
+		}
+
+	if ( ! synchronous_commit.empty() )
+		{
+		const char* value = synchronous_commit.c_str();
+		PGresult *res = PQexecParams(conn, "SELECT set_config('synchronous_commit', $1, false);",
+				1, NULL, &value, NULL, NULL, 0);
+
+		bool ok = PQresultStatus(res) == PGRES_TUPLES_OK;
+		PQclear(res);
+
+		if ( ! ok )
+			{
+			error = std::string("Could not set synchronous_commit: ") + PQerrorMessage(conn);
+			return false;
+			}
+		}
+
+	bool binary = false;
+	for ( Oid type : param_types )
+		binary = binary || type != 0;
+
+	PGresult *res = PQprepare(conn, statement.c_str(), insert.c_str(), nparams,
+			binary ? &param_types[0] : NULL);
+
+	bool ok = PQresultStatus(res) == PGRES_COMMAND_OK;
+	PQclear(res);
+
+	if ( ! ok )
+		{
+		error = std::string("Could not prepare insert statement: ") + PQerrorMessage(conn);
+		return false;
+		}
+
+	return true;
+	}
+
+bool ShardWorker::Start(std::string& error)
+	{
+	if ( ! Connect(error) )
+		return false;
+
+	thread = std::thread(&ShardWorker::Run, this);
+	return true;
+	}
+
+void ShardWorker::Add(int arg_nparams, const char* const* arg_values, const int* arg_lengths, const int* arg_formats)
+	{
+	std::unique_lock<std::mutex> lock(mutex);
+	changed.wait(lock, [this] { return queued.rows < max_queued; });
+
+	for ( int i = 0; i < arg_nparams; ++i )
+		{
+		Param param;
+		param.offset = queued.data.size();
+		param.length = arg_lengths[i];
+		param.format = arg_formats[i];
+		param.null = arg_values[i] == nullptr;
+
+		if ( ! param.null )
+			{
+			// text parameters have to be null-terminated
+			queued.data.append(arg_values[i], arg_lengths[i]);
+			queued.data += '\0';
+			}
+
+		queued.params.push_back(param);
+		}
+
+	++queued.rows;
+	lock.unlock();
+
+	changed.notify_all();
+	}
+
+void ShardWorker::Wait()
+	{
+	std::unique_lock<std::mutex> lock(mutex);
+	changed.wait(lock, [this] { return queued.rows == 0 && ! busy; });
+	}
+
+uint64_t ShardWorker::Queued()
+	{
+	std::lock_guard<std::mutex> lock(mutex);
+	return queued.rows + ( busy ? sending.rows : 0 );
+	}
+
+void ShardWorker::TakeErrors(std::vector<std::string>& out)
+	{
+	if ( ! has_errors )
+		return;
+
+	std::lock_guard<std::mutex> lock(mutex);
+
+	for ( auto& error : errors )
+		out.push_back(std::move(error));
+
+	errors.clear();
+	has_errors = false;
+	}
+
+void ShardWorker::TakeWritten(uint64_t& rows, uint64_t& bytes)
+	{
+	rows += written_rows.exchange(0);
+	bytes += written_bytes.exchange(0);
+	}
+
+void ShardWorker::AddError(const std::string& msg)
+	{
+	std::lock_guard<std::mutex> lock(mutex);
+	errors.push_back(msg);
+	has_errors = true;
+	}
+
+void ShardWorker::Run()
+	{
+	std::unique_lock<std::mutex> lock(mutex);
+
+	for ( ;; )
+		{
+		changed.wait(lock, [this] { return stop || queued.rows > 0; });
+
+		if ( queued.rows == 0 )
+			break;
+
+		// the writer thread can queue the next rows while we send these
+		std::swap(queued, sending);
+		busy = true;
+		lock.unlock();
+		changed.notify_all();
+
+		Send();
+		sending.Clear();
+
+		lock.lock();
+		busy = false;
+		changed.notify_all();
+		}
+	}
+
+// sets up the parameters of row i of the batch that is sent
+void ShardWorker::Row(size_t i)
+	{
+	values.resize(nparams);
+	lengths.resize(nparams);
+	formats.resize(nparams);
+
+	for ( int j = 0; j < nparams; ++j )
+		{
+		const Param& param = sending.params[i * nparams + j];
+		values[j] = param.null ? nullptr : sending.data.data() + param.offset;
+		lengths[j] = param.length;
+		formats[j] = param.format;
+		}
+	}
+
+// encoded size of the row set up by Row()
+uint64_t ShardWorker::RowBytes() const
+	{
+	uint64_t bytes = 0;
+
+	for ( int j = 0; j < nparams; ++j )
+		{
+		if ( values[j] )
+			bytes += lengths[j];
+		}
+
+	return bytes;
+	}
+
+// Inserts the rows of the current batch. If that fails, they are inserted one at a time, so
+// that failing rows are reported and dropped like in insert mode.
+void ShardWorker::Send()
+	{
+	std::string error;
+
+	if ( PQstatus(conn) == CONNECTION_BAD && ! Connect(error) )
+		{
+		AddError(error + " - " + std::to_string(sending.rows) + " rows lost");
+		return;
+		}
+
+	if ( SendPipelined() )
+		return;
+
+	for ( size_t i = 0; i < sending.rows; ++i )
+		{
+		Row(i);
+
+		PGresult *res = PQexecPrepared(conn, statement.c_str(), nparams, &values[0], &lengths[0], &formats[0], 0);
+
+		// retry once after reconnecting
+		if ( PQresultStatus(res) != PGRES_COMMAND_OK && PQstatus(conn) == CONNECTION_BAD )
+			{
+			PQclear(res);
+
+			if ( ! Connect(error) )
+				{
+				AddError(error + " - " + std::to_string(sending.rows - i) + " rows lost");
+				return;
+				}
+
+			res = PQexecPrepared(conn, statement.c_str(), nparams, &values[0], &lengths[0], &formats[0], 0);
+			}
+
+		if ( PQresultStatus(res) != PGRES_COMMAND_OK )
+			AddError(std::string("Command failed: ") + PQerrorMessage(conn));
+		else
+			{
+			++written_rows;
+			written_bytes += RowBytes();
+			}
+
+		PQclear(res);
+		}
+	}
+
+// Sends all rows of the current batch in pipeline mode with a single sync point, so they are
+// inserted in one implicit transaction without waiting for each row. Returns false if any of
+// the rows failed; none of them are inserted in that case.
+bool ShardWorker::SendPipelined()
+	{
+#ifdef LIBPQ_HAS_PIPELINING
+	if ( PQenterPipelineMode(conn) != 1 )
+		return false;
+
+	bool ok = true;
+	size_t sent = 0;
+	uint64_t bytes = 0;
+
+	for ( ; ok && sent < sending.rows; ++sent )
+		{
+		Row(sent);
+		bytes += RowBytes();
+		ok = PQsendQueryPrepared(conn, statement.c_str(), nparams, &values[0], &lengths[0], &formats[0], 0) == 1;
+		}
+
+	// Without the sync, the server runs nothing that was sent, and there is nothing to
+	// collect; the rows are sent one at a time then, see Send.
+	if ( PQpipelineSync(conn) != 1 )
+		{
+		LeavePipeline();
+		return false;
+		}
+
+	// Each query ends with a null result, the sync with PGRES_PIPELINE_SYNC. Stop at the sync,
+	// or if the connection failed and libpq cannot return anything anymore.
+	size_t nulls = 0;
+
+	for ( ;; )
+		{
+		PGresult *res = PQgetResult(conn);
+
+		if ( res == nullptr )
+			{
+			if ( PQstatus(conn) == CONNECTION_BAD || ++nulls > sent )
+				{
+				ok = false;
+				break;
+				}
+
+			continue;
+			}
+
+		ExecStatusType status = PQresultStatus(res);
+		PQclear(res);
+
+		if ( status == PGRES_PIPELINE_SYNC )
+			break;
+
+		if ( status != PGRES_COMMAND_OK )
+			ok = false;
+		}
+
+	if ( ! LeavePipeline() || ! ok )
+		return false;
+
+	written_rows += sending.rows;
+	written_bytes += bytes;
+	return true;
+#else
+	return false;
+#endif
+	}
+
+// Leaves pipeline mode. If results are left, e.g. after a failure, the connection is set up
+// again instead, as it cannot be used outside of the pipeline before they are collected.
+bool ShardWorker::LeavePipeline()
+	{
+#ifdef LIBPQ_HAS_PIPELINING
+	if ( PQexitPipelineMode(conn) == 1 )
+		return true;
+
+	std::string error;
+	if ( ! Connect(error) )
+		AddError(error);
+#endif
+
+	return false;
+	}
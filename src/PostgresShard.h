@@ -0,0 +1,112 @@
+// See the file "COPYING" in the main distribution directory for copyright.
+//
+// Worker threads that insert the rows of one log stream over several connections.
+
+#ifndef LOGGING_WRITER_POSTGRES_SHARD_H
+#define LOGGING_WRITER_POSTGRES_SHARD_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "libpq-fe.h"
+
+namespace logging { namespace writer {
+
+// A worker with its own connection and thread. The writer thread queues encoded rows;
+// the worker inserts everything that was queued since its last round using the prepared
+// insert statement. Failures are collected as messages for the writer thread to report,
+// as only the writer thread may report errors to Zeek.
+class ShardWorker {
+public:
+	ShardWorker(const std::string& conninfo, const std::string& statement, const std::string& insert,
+		    const std::vector<Oid>& param_types, const std::string& synchronous_commit, uint64_t max_queued);
+	~ShardWorker();
+
+	// prohibit copying and moving
+	ShardWorker(const ShardWorker&) = delete;
+	ShardWorker& operator=(const ShardWorker&) = delete;
+
+	// Connects and starts the thread. Returns false and sets error if connecting failed.
+	bool Start(std::string& error);
+
+	// Queues a row. Parameters are given in the form they are passed to libpq; values
+	// that are nullptr are NULL. Blocks while max_queued rows are queued.
+	void Add(int nparams, const char* const* values, const int* lengths, const int* formats);
+
+	// blocks until all queued rows were written
+	void Wait();
+
+	// number of rows queued or being written
+	uint64_t Queued();
+
+	// moves the messages of failures since the last call to errors
+	void TakeErrors(std::vector<std::string>& errors);
+
+	// adds the number and encoded size of the rows the database accepted since the last call
+	void TakeWritten(uint64_t& rows, uint64_t& bytes);
+
+private:
+	struct Param {
+		size_t offset;
+		int length;
+		int format;
+		bool null;
+	};
+
+	// rows queued for, or being written by, the worker
+	struct Batch {
+		std::string data;
+		std::vector<Param> params;
+		size_t rows = 0;
+
+		void Clear()	{ data.clear(); params.clear(); rows = 0; }
+	};
+
+	bool Connect(std::string& error);
+	void Run();
+	void Send();
+	bool SendPipelined();
+	bool LeavePipeline();
+	void Row(size_t i);
+	uint64_t RowBytes() const;
+	void AddError(const std::string& msg);
+
+	std::string conninfo;
+	std::string statement;
+	std::string insert;
+	std::vector<Oid> param_types;
+	std::string synchronous_commit;
+	uint64_t max_queued;
+	int nparams;
+
+	PGconn* conn;
+	std::thread thread;
+
+	std::mutex mutex;
+	std::condition_variable changed;
+	Batch queued; // filled by the writer thread
+	Batch sending; // only used by the worker
+	bool busy;
+	bool stop;
+
+	std::atomic<bool> has_errors;
+	std::vector<std::string> errors;
+
+	std::atomic<uint64_t> written_rows;
+	std::atomic<uint64_t> written_bytes;
+
+	// parameters of the row that is sent
+	std::vector<const char*> values;
+	std::vector<int> lengths;
+	std::vector<int> formats;
+};
+
+}
+}
+
+#endif /* LOGGING_WRITER_POSTGRES_SHARD_H */
@@ -0,0 +1,468 @@
+// See the file "COPYING" in the main distribution directory for copyright.
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "PostgresSpool.h"
+
+using namespace logging::writer;
+
+// Segment files consist of records:
+//   uint32 payload length, uint32 CRC-32 of the payload, payload
+// The payload of a record is one row:
+//   uint16 number of parameters, then for each parameter
+//   int32 length (-1 for NULL), uint8 format, data, terminating null byte (not for NULL)
+// All integers are in network byte order.
+
+static const char* segment_suffix = ".spool";
+static const size_t header_size = 8;
+
+static uint32_t Crc32(const char* data, size_t len)
+	{
+	static uint32_t table[256];
+	static bool initialized = false;
+
+	if ( ! initialized )
+		{
+		for ( uint32_t i = 0; i < 256; ++i )
+			{
+			uint32_t c = i;
+			for ( int k = 0; k < 8; ++k )
+				c = c & 1 ? 0xedb88320 ^ (c >> 1) : c >> 1;
+			table[i] = c;
+			}
+
+		initialized = true;
+		}
+
+	uint32_t crc = 0xffffffff;
+	for ( size_t i = 0; i < len; ++i )
+		crc = table[(crc ^ static_cast<uint8_t>(data[i])) & 0xff] ^ (crc >> 8);
+
+	return crc ^ 0xffffffff;
+	}
+
+static void AppendUint(std::string& out, uint32_t val, int bytes)
+	{
+	for ( int i = bytes - 1; i >= 0; --i )
+		out += static_cast<char>((val >> (i * 8)) & 0xff);
+	}
+
+static uint32_t ReadUint(const char* data, int bytes)
+	{
+	uint32_t val = 0;
+	for ( int i = 0; i < bytes; ++i )
+		val = (val << 8) | static_cast<uint8_t>(data[i]);
+	return val;
+	}
+
+// Reads the record at the current position of file into buffer; remaining is the number of
+// bytes left in the file. Returns false at the end of the file, and for records that are
+// incomplete or corrupt.
+static bool ReadRecord(FILE* file, uint64_t remaining, std::string& buffer)
+	{
+	char header[header_size];
+	if ( remaining < header_size || fread(header, 1, header_size, file) != header_size )
+		return false;
+
+	uint32_t length = ReadUint(header, 4);
+	uint32_t crc = ReadUint(header + 4, 4);
+
+	// a damaged header must not make us allocate more than the file holds
+	if ( length > remaining - header_size )
+		return false;
+
+	size_t start = buffer.size();
+	buffer.resize(start + length);
+
+	if ( fread(&buffer[start], 1, length, file) != length || Crc32(&buffer[start], length) != crc )
+		{
+		buffer.resize(start);
+		return false;
+		}
+
+	return true;
+	}
+
+Spool::Spool(const std::string& arg_dir, const std::string& arg_name, uint64_t arg_max_bytes, uint64_t arg_segment_bytes)
+	: dir(arg_dir), name(arg_name), max_bytes(arg_max_bytes), segment_bytes(arg_segment_bytes)
+	{
+	// the name ends up in a file name
+	std::replace(name.begin(), name.end(), '/', '_');
+
+	write_fd = -1;
+	size = 0;
+	rows = 0;
+	read_offset = 0;
+	read_end = 0;
+	}
+
+Spool::~Spool()
+	{
+	CloseWriteSegment();
+	}
+
+void Spool::SetError(const std::string& msg)
+	{
+	error = msg;
+	}
+
+std::string Spool::SegmentPath(uint64_t seq) const
+	{
+	char buf[32];
+	snprintf(buf, sizeof(buf), ".%012llu", static_cast<unsigned long long>(seq));
+	return dir + "/" + name + buf + segment_suffix;
+	}
+
+bool Spool::Open()
+	{
+	DIR* d = opendir(dir.c_str());
+	if ( ! d )
+		{
+		SetError("Could not open spool directory " + dir + ": " + strerror(errno));
+		return false;
+		}
+
+	std::string prefix = name + ".";
+	std::vector<uint64_t> seqs;
+
+	while ( struct dirent* entry = readdir(d) )
+		{
+		std::string file = entry->d_name;
+
+		if ( file.size() <= prefix.size() + strlen(segment_suffix) ||
+		     file.compare(0, prefix.size(), prefix) != 0 ||
+		     file.compare(file.size() - strlen(segment_suffix), std::string::npos, segment_suffix) != 0 )
+			continue;
+
+		std::string seq = file.substr(prefix.size(), file.size() - prefix.size() - strlen(segment_suffix));
+		if ( seq.find_first_not_of("0123456789") != std::string::npos )
+			continue;
+
+		seqs.push_back(strtoull(seq.c_str(), nullptr, 10));
+		}
+
+	closedir(d);
+	std::sort(seqs.begin(), seqs.end());
+
+	// Count the rows of the leftover segments. A segment may end in a partial record if we
+	// crashed while writing it; it is cut off at the last complete record.
+	std::string buffer;
+
+	for ( uint64_t seq : seqs )
+		{
+		Segment segment{seq, SegmentPath(seq), 0, 0};
+
+		FILE* file = fopen(segment.path.c_str(), "rb");
+		struct stat st;
+		if ( ! file || fstat(fileno(file), &st) != 0 )
+			{
+			SetError("Could not open spool segment " + segment.path + ": " + strerror(errno));
+			if ( file )
+				fclose(file);
+			return false;
+			}
+
+		uint64_t file_size = st.st_size;
+
+		while ( ReadRecord(file, file_size - segment.size, buffer) )
+			{
+			segment.size += header_size + buffer.size();
+			++segment.rows;
+			buffer.clear();
+			}
+
+		fclose(file);
+
+		if ( segment.size < file_size )
+			warnings.push_back("Discarded " + std::to_string(file_size - segment.size) +
+					   " bytes after the last complete record of spool segment " + segment.path);
+
+		if ( truncate(segment.path.c_str(), segment.size) != 0 )
+			{
+			SetError("Could not truncate spool segment " + segment.path + ": " + strerror(errno));
+			return false;
+			}
+
+		if ( segment.rows == 0 )
+			{
+			unlink(segment.path.c_str());
+			continue;
+			}
+
+		size += segment.size;
+		rows += segment.rows;
+		segments.push_back(segment);
+		}
+
+	return true;
+	}
+
+bool Spool::OpenWriteSegment()
+	{
+	uint64_t seq = segments.empty() ? 0 : segments.back().seq + 1;
+	Segment segment{seq, SegmentPath(seq), 0, 0};
+
+	write_fd = open(segment.path.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_APPEND, 0600);
+	if ( write_fd < 0 )
+		{
+		SetError("Could not create spool segment " + segment.path + ": " + strerror(errno));
+		return false;
+		}
+
+	// make sure that the directory entry of the new segment survives a crash
+	int dir_fd = open(dir.c_str(), O_RDONLY);
+	if ( dir_fd >= 0 )
+		{
+		fsync(dir_fd);
+		close(dir_fd);
+		}
+
+	segments.push_back(segment);
+	return true;
+	}
+
+void Spool::CloseWriteSegment()
+	{
+	if ( write_fd < 0 )
+		return;
+
+	fsync(write_fd);
+	close(write_fd);
+	write_fd = -1;
+	}
+
+bool Spool::Append(int nparams, const char* const* values, const int* lengths, const int* formats)
+	{
+	record.clear();
+	AppendUint(record, 0, 4); // length and checksum, filled in below
+	AppendUint(record, 0, 4);
+	AppendUint(record, nparams, 2);
+
+	for ( int i = 0; i < nparams; ++i )
+		{
+		if ( values[i] == nullptr )
+			{
+			AppendUint(record, static_cast<uint32_t>(-1), 4);
+			record += '\0';
+			continue;
+			}
+
+		AppendUint(record, lengths[i], 4);
+		record += static_cast<char>(formats[i]);
+		record.append(values[i], lengths[i]);
+		record += '\0';
+		}
+
+	uint32_t length = record.size() - header_size;
+	uint32_t crc = Crc32(record.data() + header_size, length);
+	for ( int i = 0; i < 4; ++i )
+		{
+		record[i] = static_cast<char>((length >> ((3 - i) * 8)) & 0xff);
+		record[4 + i] = static_cast<char>((crc >> ((3 - i) * 8)) & 0xff);
+		}
+
+	if ( size + record.size() > max_bytes )
+		{
+		SetError("Spool is full");
+		return false;
+		}
+
+	if ( write_fd >= 0 && segments.back().size >= segment_bytes )
+		CloseWriteSegment();
+
+	if ( write_fd < 0 && ! OpenWriteSegment() )
+		return false;
+
+	Segment& segment = segments.back();
+	size_t written = 0;
+
+	while ( written < record.size() )
+		{
+		ssize_t n = write(write_fd, record.data() + written, record.size() - written);
+		if ( n < 0 && errno == EINTR )
+			continue;
+
+		if ( n <= 0 )
+			{
+			SetError("Could not write to spool segment " + segment.path + ": " + strerror(errno));
+			// do not leave a partial record behind
+			if ( ftruncate(write_fd, segment.size) != 0 )
+				CloseWriteSegment();
+			return false;
+			}
+
+		written += n;
+		}
+
+	segment.size += record.size();
+	++segment.rows;
+	size += record.size();
+	++rows;
+
+	return true;
+	}
+
+bool Spool::Sync()
+	{
+	if ( write_fd >= 0 && fdatasync(write_fd) != 0 )
+		{
+		SetError(std::string("Could not sync spool: ") + strerror(errno));
+		return false;
+		}
+
+	return true;
+	}
+
+bool Spool::Read(size_t max_rows)
+	{
+	read_buffer.clear();
+	read_rows.clear();
+	read_end = read_offset;
+
+	if ( segments.empty() )
+		return true;
+
+	const Segment& segment = segments.front();
+
+	FILE* file = fopen(segment.path.c_str(), "rb");
+	if ( ! file )
+		{
+		SetError("Could not open spool segment " + segment.path + ": " + strerror(errno));
+		return false;
+		}
+
+	if ( fseeko(file, read_offset, SEEK_SET) != 0 )
+		{
+		SetError("Could not seek in spool segment " + segment.path + ": " + strerror(errno));
+		fclose(file);
+		return false;
+		}
+
+	while ( read_rows.size() < max_rows && read_end < segment.size )
+		{
+		size_t start = read_buffer.size();
+		if ( ! ReadRecord(file, segment.size - read_end, read_buffer) )
+			{
+			fclose(file);
+
+			// the rows before the damage are returned first
+			if ( ! read_rows.empty() )
+				return true;
+
+			Quarantine();
+			return false;
+			}
+
+		read_rows.push_back(start);
+		read_end += header_size + (read_buffer.size() - start);
+		}
+
+	fclose(file);
+	return true;
+	}
+
+bool Spool::Row(size_t i, std::vector<const char*>& values, std::vector<int>& lengths, std::vector<int>& formats) const
+	{
+	size_t end = i + 1 < read_rows.size() ? read_rows[i + 1] : read_buffer.size();
+	const char* p = read_buffer.data() + read_rows[i];
+	const char* last = read_buffer.data() + end;
+
+	if ( last - p < 2 )
+		return false;
+
+	int nparams = ReadUint(p, 2);
+	p += 2;
+
+	values.resize(nparams);
+	lengths.resize(nparams);
+	formats.resize(nparams);
+
+	for ( int j = 0; j < nparams; ++j )
+		{
+		if ( last - p < 5 )
+			return false;
+
+		int32_t length = static_cast<int32_t>(ReadUint(p, 4));
+		formats[j] = static_cast<uint8_t>(p[4]);
+		p += 5;
+
+		if ( length < 0 )
+			{
+			values[j] = nullptr;
+			lengths[j] = 0;
+			continue;
+			}
+
+		if ( last - p < length + 1 )
+			return false;
+
+		values[j] = p;
+		lengths[j] = length;
+		p += length + 1;
+		}
+
+	return true;
+	}
+
+// Moves the rest of the oldest segment, which has a corrupt record at the read offset, out
+// of the way, so that replaying goes on with the next segment. Records after the damaged one
+// may be intact, but cannot be found reliably; the file is kept for inspection as
+// <segment>.corrupt, and is not picked up by Open().
+void Spool::Quarantine()
+	{
+	Segment& segment = segments.front();
+	std::string corrupt = segment.path + ".corrupt";
+
+	// new rows go to a new segment
+	if ( segments.size() == 1 )
+		CloseWriteSegment();
+
+	if ( rename(segment.path.c_str(), corrupt.c_str()) == 0 )
+		SetError("Corrupt record in spool segment " + segment.path + ", moved it to " + corrupt + " - " +
+			 std::to_string(segment.rows) + " rows lost");
+	else
+		{
+		SetError("Corrupt record in spool segment " + segment.path + ", removed it - " +
+			 std::to_string(segment.rows) + " rows lost");
+		unlink(segment.path.c_str());
+		}
+
+	rows -= segment.rows;
+	size -= segment.size;
+	segments.pop_front();
+	read_offset = 0;
+	read_end = 0;
+	}
+
+void Spool::Consume()
+	{
+	if ( segments.empty() )
+		return;
+
+	rows -= read_rows.size();
+	segments.front().rows -= read_rows.size();
+	read_offset = read_end;
+	read_rows.clear();
+	read_buffer.clear();
+
+	Segment& segment = segments.front();
+	if ( read_offset < segment.size )
+		return;
+
+	// segment is done
+	if ( segments.size() == 1 )
+		CloseWriteSegment();
+
+	unlink(segment.path.c_str());
+	size -= segment.size;
+	segments.pop_front();
+	read_offset = 0;
+	read_end = 0;
+	}
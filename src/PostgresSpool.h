@@ -0,0 +1,103 @@
+// See the file "COPYING" in the main distribution directory for copyright.
+//
+// On-disk spool for rows that cannot be written to the database right away.
+
+#ifndef LOGGING_WRITER_POSTGRES_SPOOL_H
+#define LOGGING_WRITER_POSTGRES_SPOOL_H
+
+#include <cstdint>
+#include <deque>
+#include <string>
+#include <vector>
+
+namespace logging { namespace writer {
+
+// Append-only spool of encoded rows, split into segment files. Every record carries its
+// length and a checksum, so that a segment that was cut short by a crash can be read up
+// to the last complete record. Segments are removed once all of their rows were replayed.
+//
+// Rows are replayed at least once: if Zeek crashes while a segment is being replayed, the
+// rows of that segment that were already written are replayed again on the next start.
+class Spool {
+public:
+	Spool(const std::string& dir, const std::string& name, uint64_t max_bytes, uint64_t segment_bytes);
+	~Spool();
+
+	// prohibit copying and moving
+	Spool(const Spool&) = delete;
+	Spool& operator=(const Spool&) = delete;
+
+	// Picks up segments left over from earlier runs. Returns false on error. Segments that
+	// end in a partial or corrupt record are cut off before it; see Warnings().
+	bool Open();
+
+	// messages about the data discarded by Open()
+	const std::vector<std::string>& Warnings() const	{ return warnings; }
+
+	// Appends a row. Parameters are given in the form they are passed to libpq; values
+	// that are nullptr are NULL. Returns false if the spool is full or on I/O errors.
+	bool Append(int nparams, const char* const* values, const int* lengths, const int* formats);
+
+	// Writes buffered data to disk.
+	bool Sync();
+
+	bool Empty() const	{ return size == 0; }
+	uint64_t Size() const	{ return size; }
+	uint64_t Rows() const	{ return rows; }
+
+	// Reads up to max_rows rows from the oldest segment, starting after the rows that were
+	// already consumed. Rows stay in the spool until Consume() is called. If the next record
+	// is corrupt, the rest of the segment is moved aside and false is returned once; the
+	// next call goes on with the following segment.
+	bool Read(size_t max_rows);
+
+	// number of rows returned by the last Read()
+	size_t NumRead() const	{ return read_rows.size(); }
+
+	// Decodes row i of the last Read() into the arrays passed to libpq. They stay valid
+	// until the next call to Read().
+	bool Row(size_t i, std::vector<const char*>& values, std::vector<int>& lengths, std::vector<int>& formats) const;
+
+	// Marks the rows returned by the last Read() as written.
+	void Consume();
+
+	const std::string& LastError() const	{ return error; }
+
+private:
+	struct Segment {
+		uint64_t seq;
+		std::string path;
+		uint64_t size;
+		uint64_t rows;
+	};
+
+	std::string SegmentPath(uint64_t seq) const;
+	bool OpenWriteSegment();
+	void CloseWriteSegment();
+	void Quarantine();
+	void SetError(const std::string& msg);
+
+	std::string dir;
+	std::string name;
+	uint64_t max_bytes;
+	uint64_t segment_bytes;
+
+	std::deque<Segment> segments; // oldest first; the last one is the one we write to
+	int write_fd;
+	uint64_t size; // total size of all segments
+	uint64_t rows; // rows in all segments that were not consumed yet
+
+	uint64_t read_offset; // offset of the first row of the oldest segment not consumed yet
+	uint64_t read_end; // offset after the rows returned by the last Read()
+	std::string read_buffer;
+	std::vector<size_t> read_rows; // offsets of records in read_buffer
+
+	std::string record; // reused buffer for the record that is being appended
+	std::string error;
+	std::vector<std::string> warnings;
+};
+
+}
+}
+
+#endif /* LOGGING_WRITER_POSTGRES_SPOOL_H */
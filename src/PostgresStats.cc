@@ -0,0 +1,83 @@
+// See the file "COPYING" in the main distribution directory for copyright.
+
+#include <algorithm>
+#include <cmath>
+
+#include "zeek/Event.h"
+#include "zeek/EventRegistry.h"
+#include "zeek/Val.h"
+
+#include "PostgresStats.h"
+#include "postgresql.bif.h"
+
+using namespace logging::writer;
+
+constexpr double WriterStats::latency_bounds[];
+
+void WriterStats::AddLatency(double seconds)
+	{
+	++statements;
+	latency_total += seconds;
+
+	if ( seconds > latency_max )
+		latency_max = seconds;
+
+	int bucket = 0;
+	while ( bucket < latency_buckets - 1 && seconds >= latency_bounds[bucket] )
+		++bucket;
+
+	++latency_histogram[bucket];
+
+	double usec = seconds * 1e6;
+	int fine_bucket = 0;
+	if ( usec >= 1 )
+		fine_bucket = std::min(static_cast<int>(std::log10(usec) * fine_latency_buckets_per_decade) + 1,
+				       fine_latency_buckets - 1);
+
+	++latency_fine_histogram[fine_bucket];
+	}
+
+StatsMessage::StatsMessage(zeek::logging::WriterFrontend* frontend, const std::string& arg_path, double arg_time,
+			   const WriterStats& arg_stats)
+	: zeek::threading::OutputMessage<zeek::logging::WriterFrontend>("PostgreSQLStats", frontend),
+	  path(arg_path), time(arg_time), stats(arg_stats)
+	{
+	}
+
+bool StatsMessage::Process()
+	{
+	static zeek::EventHandlerPtr writer_stats = zeek::event_registry->Lookup("LogPostgres::writer_stats");
+
+	if ( ! writer_stats )
+		return true;
+
+	auto histogram = zeek::make_intrusive<zeek::VectorVal>(zeek::id::index_vec);
+	for ( uint64_t count : stats.latency_histogram )
+		histogram->Append(zeek::val_mgr->Count(count));
+
+	auto fine_histogram = zeek::make_intrusive<zeek::VectorVal>(zeek::id::index_vec);
+	for ( uint64_t count : stats.latency_fine_histogram )
+		fine_histogram->Append(zeek::val_mgr->Count(count));
+
+	double mean = stats.statements > 0 ? stats.latency_total / stats.statements : 0;
+
+	auto rec = zeek::make_intrusive<zeek::RecordVal>(zeek::BifType::Record::LogPostgres::WriterStats);
+	rec->Assign(0, zeek::make_intrusive<zeek::TimeVal>(time));
+	rec->Assign(1, zeek::make_intrusive<zeek::StringVal>(path));
+	rec->Assign(2, zeek::val_mgr->Count(stats.rows));
+	rec->Assign(3, zeek::val_mgr->Count(stats.bytes));
+	rec->Assign(4, zeek::val_mgr->Count(stats.statements));
+	rec->Assign(5, zeek::val_mgr->Count(stats.errors));
+	rec->Assign(6, zeek::val_mgr->Count(stats.ignored_errors));
+	rec->Assign(7, zeek::val_mgr->Count(stats.failed_rows));
+	rec->Assign(8, zeek::make_intrusive<zeek::IntervalVal>(mean));
+	rec->Assign(9, zeek::make_intrusive<zeek::IntervalVal>(stats.latency_max));
+	rec->Assign(10, std::move(histogram));
+	rec->Assign(11, zeek::make_intrusive<zeek::IntervalVal>(stats.encode_time));
+	rec->Assign(12, zeek::val_mgr->Count(stats.queued));
+	rec->Assign(13, zeek::val_mgr->Count(stats.spooled));
+	rec->Assign(14, std::move(fine_histogram));
+
+	zeek::event_mgr.Enqueue(writer_stats, std::move(rec));
+	return true;
+	}
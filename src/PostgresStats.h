@@ -0,0 +1,65 @@
+// See the file "COPYING" in the main distribution directory for copyright.
+//
+// Performance counters of a PostgreSQL writer, reported to script land as an event.
+
+#ifndef LOGGING_WRITER_POSTGRES_STATS_H
+#define LOGGING_WRITER_POSTGRES_STATS_H
+
+#include <cstdint>
+#include <string>
+
+#include "zeek/logging/WriterFrontend.h"
+#include "zeek/threading/MsgThread.h"
+
+namespace logging { namespace writer {
+
+// Counters collected by the writer thread since the last report.
+struct WriterStats {
+	// upper bounds of the latency histogram buckets in seconds; the last bucket is unbounded
+	static constexpr double latency_bounds[] = { 0.001, 0.01, 0.1, 1, 10 };
+	static constexpr int latency_buckets = sizeof(latency_bounds) / sizeof(latency_bounds[0]) + 1;
+
+	// The fine latency histogram has four buckets per decade between 1us and 10s: bucket 0
+	// counts statements below 1us, bucket i those below 10^(i/4) us, and the last bucket the
+	// ones of 10s and more.
+	static constexpr int fine_latency_buckets_per_decade = 4;
+	static constexpr int fine_latency_buckets = 7 * fine_latency_buckets_per_decade + 2;
+
+	uint64_t rows = 0; // rows the database accepted
+	uint64_t bytes = 0; // encoded size of these rows
+	uint64_t statements = 0; // inserts, batches and COPYs
+	uint64_t errors = 0; // failed statements
+	uint64_t ignored_errors = 0; // failed statements skipped because of continue_on_errors
+	uint64_t failed_rows = 0; // rows of the failed statements
+	double latency_total = 0; // seconds
+	double latency_max = 0;
+	uint64_t latency_histogram[latency_buckets] = {};
+	uint64_t latency_fine_histogram[fine_latency_buckets] = {};
+	double encode_time = 0; // seconds spent rendering values
+
+	// sampled when the counters are reported
+	uint64_t queued = 0; // rows waiting in batches, COPYs, pipelines, transactions and shards
+	uint64_t spooled = 0;
+
+	void AddLatency(double seconds);
+	void Reset()	{ *this = WriterStats(); }
+};
+
+// Raises LogPostgres::writer_stats for the counters of one writer on the main thread.
+class StatsMessage : public zeek::threading::OutputMessage<zeek::logging::WriterFrontend> {
+public:
+	StatsMessage(zeek::logging::WriterFrontend* frontend, const std::string& path, double time,
+		     const WriterStats& stats);
+
+	bool Process() override;
+
+private:
+	std::string path;
+	double time;
+	WriterStats stats;
+};
+
+}
+}
+
+#endif /* LOGGING_WRITER_POSTGRES_STATS_H */
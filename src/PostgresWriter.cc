@@ -3,11 +3,19 @@
 #include <string>
 #include <errno.h>
 #include <vector>
-#include <regex>
+#include <algorithm>
+#include <charconv>
+#include <cinttypes>
+#include <cmath>
+#include <ctime>
+#include <atomic>
+#include <arpa/inet.h>
+#include <poll.h>
 
 #include "zeek/zeek-config.h"
 
 #include "zeek/NetVar.h"
+#include "zeek/util.h"
 #include "zeek/threading/SerialTypes.h"
 
 #include "PostgresWriter.h"
@@ -18,10 +26,15 @@ using namespace writer;
 using zeek::threading::Value;
 using zeek::threading::Field;
 
+// name of the prepared insert statement. Writers sharing a connection pool get a number
+// appended to it, as their statements are prepared on the same connections.
+static const char* insert_statement = "zeek_insert";
+static std::atomic<uint64_t> pooled_writers(0);
+
+static void AppendJsonString(std::string& out, const char* data, size_t length);
+
 PostgreSQL::PostgreSQL(zeek::logging::WriterFrontend* frontend) : zeek::logging::WriterBackend(frontend)
 	{
-	io = std::unique_ptr<zeek::threading::formatter::Ascii>(new zeek::threading::formatter::Ascii(this, zeek::threading::formatter::Ascii::SeparatorInfo()));
-
 	default_hostname.assign(
 		(const char*) zeek::BifConst::LogPostgres::default_hostname->Bytes(),
 		zeek::BifConst::LogPostgres::default_hostname->Len()
@@ -34,14 +47,79 @@ PostgreSQL::PostgreSQL(zeek::logging::WriterFrontend* frontend) : zeek::logging:
 
 	default_port = zeek::BifConst::LogPostgres::default_port;
 
+	conn = nullptr;
+	pool = nullptr;
+	pooled = nullptr;
+	statement = insert_statement;
 	ignore_errors = false;
 	bytea_instead_text = false;
+	binary_params = false;
+
+	mode = MODE_INSERT;
+	copy_in_progress = false;
+	copy_rows = 0;
+	copy_bytes = 0;
+	copy_max_rows = 10000;
+	copy_max_bytes = 8 * 1024 * 1024;
+
+	pipeline_depth = 256;
+	in_flight = 0;
+	need_prepare = false;
+
+	batch_size = 1000;
+	batch_rows = 0;
+
+	transactions = false;
+	buffered = true;
+	in_transaction = false;
+	has_savepoint = false;
+	transaction_rows = 0;
+	commit_rows = 1000;
+	commit_interval = 1000;
+
+	partition_interval = 0;
+	partition_retention = 0;
+	partition_detach = false;
+	partition_until = 0;
+	partition_retry = 0;
+
+	table_ready = false;
+	spooling = false;
+	spool_latency = 0;
+	spool_retry = 10;
+	spool_replay_rows = 10000;
+	spool_dropped = 0;
+	reconnecting = false;
+	need_setup = false;
+	reconnect_status = PGRES_POLLING_FAILED;
+
+	shard_key = -1;
+	next_shard = 0;
+
+	native_types = false;
+	partition_timestamptz = false;
+
+	id_column = ID_SERIAL;
+	unlogged = false;
+	indexes_built = false;
+
+	writer_frontend = frontend;
+	stats_interval = zeek::BifConst::LogPostgres::stats_interval;
+	collect_stats = stats_interval > 0;
+	stats_reported = 0;
+	side = nullptr;
 	}
 
 PostgreSQL::~PostgreSQL()
 	{
-	if ( conn != 0 )
+	// stops the workers; everything was flushed in DoFinish
+	shards.clear();
+
+	if ( pooled )
+		pool->Release(pooled);
+	else if ( conn != 0 )
 		PQfinish(conn);
+
 	}
 
 std::string PostgreSQL::GetTableType(int arg_type, int arg_subtype)
@@ -55,10 +133,13 @@ std::string PostgreSQL::GetTableType(int arg_type, int arg_subtype)
 
 	case zeek::TYPE_INT:
 	case zeek::TYPE_COUNT:
-	case zeek::TYPE_PORT:
 		type = "bigint";
 		break;
 
+	case zeek::TYPE_PORT:
+		type = native_types ? "integer" : "bigint";
+		break;
+
 	/*
 	case zeek::TYPE_PORT:
 		type = "VARCHAR(10)";
@@ -70,7 +151,13 @@ std::string PostgreSQL::GetTableType(int arg_type, int arg_subtype)
 		break;
 
 	case zeek::TYPE_TIME:
+		type = native_types ? "timestamptz" : "double precision";
+		break;
+
 	case zeek::TYPE_INTERVAL:
+		type = native_types ? "interval" : "double precision";
+		break;
+
 	case zeek::TYPE_DOUBLE:
 		type = "double precision";
 		break;
@@ -100,15 +187,179 @@ std::string PostgreSQL::GetTableType(int arg_type, int arg_subtype)
 	return type;
 }
 
+// Type OIDs as defined in the server's pg_type.dat. These are stable across versions.
+static const Oid BOOLOID = 16;
+static const Oid INT8OID = 20;
+static const Oid FLOAT8OID = 701;
+static const Oid INETOID = 869;
+static const Oid CIDROID = 650;
+static const Oid TEXTOID = 25;
+static const Oid BYTEAOID = 17;
+static const Oid BOOLARRAYOID = 1000;
+static const Oid INT8ARRAYOID = 1016;
+static const Oid FLOAT8ARRAYOID = 1022;
+static const Oid INETARRAYOID = 1041;
+static const Oid TEXTARRAYOID = 1009;
+static const Oid BYTEAARRAYOID = 1001;
+static const Oid INT4OID = 23;
+static const Oid TIMESTAMPTZOID = 1184;
+static const Oid INTERVALOID = 1186;
+static const Oid INT4ARRAYOID = 1007;
+static const Oid TIMESTAMPTZARRAYOID = 1185;
+static const Oid INTERVALARRAYOID = 1187;
+
+// name of the enum type of the protocol columns added for ports with native_types
+static const char* proto_type = "zeek_transport_proto";
+
+// seconds between the Unix epoch and the PostgreSQL epoch (2000-01-01)
+static const double postgres_epoch = 946684800.0;
+
+// returns the element type of the array types returned by GetBinaryType; 0 if not an array
+static Oid GetElementType(Oid array_type)
+	{
+	switch ( array_type ) {
+	case BOOLARRAYOID:
+		return BOOLOID;
+	case INT8ARRAYOID:
+		return INT8OID;
+	case FLOAT8ARRAYOID:
+		return FLOAT8OID;
+	case INETARRAYOID:
+		return INETOID;
+	case TEXTARRAYOID:
+		return TEXTOID;
+	case BYTEAARRAYOID:
+		return BYTEAOID;
+	case INT4ARRAYOID:
+		return INT4OID;
+	case TIMESTAMPTZARRAYOID:
+		return TIMESTAMPTZOID;
+	case INTERVALARRAYOID:
+		return INTERVALOID;
+	default:
+		return 0;
+	}
+	}
+
+// returns the OID of the type that values are encoded to by CreateBinaryParams; 0 if
+// the type has no binary encoder and is sent in the text format.
+Oid PostgreSQL::GetBinaryType(int arg_type, int arg_subtype)
+	{
+	switch ( arg_type ) {
+	case zeek::TYPE_TABLE:
+	case zeek::TYPE_VECTOR:
+		switch ( arg_subtype ) {
+		case zeek::TYPE_BOOL:
+			return BOOLARRAYOID;
+
+		case zeek::TYPE_INT:
+		case zeek::TYPE_COUNT:
+			return INT8ARRAYOID;
+
+		case zeek::TYPE_PORT:
+			return native_types ? INT4ARRAYOID : INT8ARRAYOID;
+
+		case zeek::TYPE_TIME:
+			return native_types ? TIMESTAMPTZARRAYOID : FLOAT8ARRAYOID;
+
+		case zeek::TYPE_INTERVAL:
+			return native_types ? INTERVALARRAYOID : FLOAT8ARRAYOID;
+
+		case zeek::TYPE_DOUBLE:
+			return FLOAT8ARRAYOID;
+
+		case zeek::TYPE_ADDR:
+		case zeek::TYPE_SUBNET:
+			return INETARRAYOID;
+
+		case zeek::TYPE_ENUM:
+			return TEXTARRAYOID;
+
+		case zeek::TYPE_STRING:
+		case zeek::TYPE_FILE:
+		case zeek::TYPE_FUNC:
+			return bytea_instead_text ? BYTEAARRAYOID : TEXTARRAYOID;
+
+		default:
+			return 0;
+		}
+
+	case zeek::TYPE_BOOL:
+		return BOOLOID;
+
+	case zeek::TYPE_INT:
+	case zeek::TYPE_COUNT:
+		return INT8OID;
+
+	case zeek::TYPE_PORT:
+		return native_types ? INT4OID : INT8OID;
+
+	case zeek::TYPE_TIME:
+		return native_types ? TIMESTAMPTZOID : FLOAT8OID;
+
+	case zeek::TYPE_INTERVAL:
+		return native_types ? INTERVALOID : FLOAT8OID;
+
+	case zeek::TYPE_DOUBLE:
+		return FLOAT8OID;
+
+	case zeek::TYPE_ADDR:
+		return INETOID;
+
+	case zeek::TYPE_SUBNET:
+		return CIDROID;
+
+	default:
+		return 0;
+	}
+	}
+
+// Returns the escaped name of column i. The first columns are the fields that are not stored
+// in the jsonb column; they are followed by the protocol columns of ports (only with
+// native_types), and the jsonb column.
+std::string PostgreSQL::ColumnName(const Field* const * fields, int i)
+	{
+	if ( i < FieldColumns() )
+		return EscapeIdentifier(fields[column_fields[i]]->name);
+
+	if ( i < FieldColumns() + static_cast<int>(proto_fields.size()) )
+		return EscapeIdentifier((std::string(fields[proto_fields[i - FieldColumns()]]->name) + "_proto").c_str());
+
+	return EscapeIdentifier(jsonb_column.c_str());
+	}
+
+// type of column i, see ColumnName
+std::string PostgreSQL::ColumnType(const Field* const * fields, int i)
+	{
+	if ( i >= FieldColumns() + static_cast<int>(proto_fields.size()) )
+		return "jsonb";
+
+	if ( i >= FieldColumns() )
+		return proto_type;
+
+	int field = column_fields[i];
+
+	if ( dictionary_index[field] >= 0 )
+		return "integer";
+
+	for ( const auto& column : enum_columns )
+		{
+		if ( column.field == field )
+			return column.type;
+		}
+
+	return GetTableType(fields[field]->type, fields[field]->subtype);
+	}
+
 // preformat the insert string that we only need to create once during our lifetime
 bool PostgreSQL::CreateInsert(int num_fields, const Field* const * fields, std::string add_string)
 	{
 	std::string names = "INSERT INTO "+table+" ( ";
 	std::string values("VALUES (");
 
-	for ( int i = 0; i < num_fields; ++i )
+	for ( int i = 0; i < NumColumns(); ++i )
 		{
-		std::string fieldname = EscapeIdentifier(fields[i]->name);
+		std::string fieldname = ColumnName(fields, i);
 		if ( fieldname.empty() )
 			return false;
 
@@ -127,6 +378,82 @@ bool PostgreSQL::CreateInsert(int num_fields, const Field* const * fields, std::
 	return true;
 	}
 
+// Preformat the insert statement used in MODE_BATCH. Each parameter is an array containing
+// the values of one column for all rows of a batch. Columns that are arrays themselves are
+// passed as arrays of their text representation, as unnest would flatten them otherwise.
+bool PostgreSQL::CreateBatchInsert(int num_fields, const Field* const * fields, std::string add_string)
+	{
+	std::string names = "INSERT INTO "+table+" ( ";
+	std::string select("SELECT ");
+	std::string from(" FROM unnest(");
+	std::string alias(") AS u(");
+
+	for ( int i = 0; i < NumColumns(); ++i )
+		{
+		std::string fieldname = ColumnName(fields, i);
+		if ( fieldname.empty() )
+			return false;
+
+		std::string type = ColumnType(fields, i);
+		if ( type.empty() )
+			return false;
+
+		if ( i != 0 )
+			{
+			names += ", ";
+			select += ", ";
+			from += ", ";
+			alias += ", ";
+			}
+
+		std::string column = "c" + std::to_string(i+1);
+		names += fieldname;
+		alias += column;
+
+		// the protocol and jsonb columns are scalars
+		int field = i < FieldColumns() ? column_fields[i] : -1;
+		bool array = field >= 0 && dictionary_index[field] < 0 &&
+			( fields[field]->type == zeek::TYPE_TABLE || fields[field]->type == zeek::TYPE_VECTOR );
+
+		if ( array )
+			{
+			select += column + "::" + type;
+			from += "$" + std::to_string(i+1) + "::text[]";
+			}
+		else
+			{
+			select += column;
+			from += "$" + std::to_string(i+1) + "::" + type + "[]";
+			}
+		}
+
+	insert = names + ") " + select + from + alias + ") " + add_string + ";";
+
+	return true;
+	}
+
+// preformat the copy statement used in MODE_COPY
+bool PostgreSQL::CreateCopy(int num_fields, const Field* const * fields)
+	{
+	copy = "COPY "+table+" ( ";
+
+	for ( int i = 0; i < NumColumns(); ++i )
+		{
+		std::string fieldname = ColumnName(fields, i);
+		if ( fieldname.empty() )
+			return false;
+
+		if ( i != 0 )
+			copy += ", ";
+
+		copy += fieldname;
+		}
+
+	copy += " ) FROM STDIN;";
+
+	return true;
+	}
+
 std::string PostgreSQL::LookupParam(const WriterInfo& info, const std::string name) const
 	{
 	std::map<const char*, const char*>::const_iterator it = info.config.find(name.c_str());
@@ -136,6 +463,26 @@ std::string PostgreSQL::LookupParam(const WriterInfo& info, const std::string na
 		return it->second;
 	}
 
+// looks up a numeric configuration option. Value is left untouched if the option is not set.
+bool PostgreSQL::LookupCountParam(const WriterInfo& info, const std::string name, uint64_t& value)
+	{
+	std::string str = LookupParam(info, name);
+	if ( str.empty() )
+		return true;
+
+	char* end;
+	errno = 0;
+	unsigned long long parsed = strtoull(str.c_str(), &end, 10);
+	if ( errno != 0 || *end != '\0' || str[0] == '-' )
+		{
+		Error(Fmt("Invalid value '%s' for configuration option %s", str.c_str(), name.c_str()));
+		return false;
+		}
+
+	value = parsed;
+	return true;
+	}
+
 // note - EscapeIdentifier is replicated in reader
 std::string PostgreSQL::EscapeIdentifier(const char* identifier)
 	{
@@ -151,6 +498,30 @@ std::string PostgreSQL::EscapeIdentifier(const char* identifier)
 	return out;
 	}
 
+// splits a list option at sep, trimming spaces and tabs and dropping empty entries
+static std::vector<std::string> SplitList(const std::string& list, char sep)
+	{
+	std::vector<std::string> entries;
+
+	for ( size_t start = 0; start <= list.size(); )
+		{
+		size_t end = list.find(sep, start);
+		if ( end == std::string::npos )
+			end = list.size();
+
+		size_t first = list.find_first_not_of(" \t", start);
+		if ( first != std::string::npos && first < end )
+			{
+			size_t last = list.find_last_not_of(" \t", end - 1);
+			entries.push_back(list.substr(first, last - first + 1));
+			}
+
+		start = end + 1;
+		}
+
+	return entries;
+	}
+
 bool PostgreSQL::DoInit(const WriterInfo& info, int num_fields,
 			    const Field* const * fields)
 	{
@@ -198,243 +569,3010 @@ bool PostgreSQL::DoInit(const WriterInfo& info, int num_fields,
 	if ( !bytea.empty() && bytea == "T" )
 		bytea_instead_text = true;
 
-	conn = PQconnectdb(conninfo.c_str());
-
-	if ( PQstatus(conn) != CONNECTION_OK )
-		{
-		Error(Fmt("Could not connect to pg (%s): %s", conninfo.c_str(), PQerrorMessage(conn)));
-		return false;
-		}
-
-	table = EscapeIdentifier(info.path);
-	if ( table.empty() )
-		return false;
+	std::string binary = LookupParam(info, "binary_params");
+	if ( !binary.empty() && binary == "T" )
+		binary_params = true;
 
+	std::string native = LookupParam(info, "native_types");
+	if ( !native.empty() && native == "T" )
+		native_types = true;
 
-	std::string create = "CREATE TABLE IF NOT EXISTS "+table+" (\n"
-		"id SERIAL UNIQUE NOT NULL";
+	std::string enums = LookupParam(info, "enum_types");
+	bool enum_types = !enums.empty() && enums == "T";
 
-	for ( int i = 0; i < num_fields; ++i )
-		{
-		const Field* field = fields[i];
+	std::vector<std::string> dictionary_list = SplitList(LookupParam(info, "dictionary_columns"), ',');
+	std::set<std::string> dictionary_names(dictionary_list.begin(), dictionary_list.end());
 
-		create += ",\n";
+	std::vector<std::string> jsonb_list = SplitList(LookupParam(info, "jsonb_fields"), ',');
+	std::set<std::string> jsonb_names(jsonb_list.begin(), jsonb_list.end());
 
-		std::string escaped = EscapeIdentifier(field->name);
-		if ( escaped.empty() )
-			return false;
-		create += escaped;
+	std::string jsonb_optional_str = LookupParam(info, "jsonb_optional");
+	bool jsonb_optional = !jsonb_optional_str.empty() && jsonb_optional_str == "T";
 
-		std::string type = GetTableType(field->type, field->subtype);
+	jsonb_column = LookupParam(info, "jsonb_column");
+	if ( jsonb_column.empty() )
+		jsonb_column = "extra";
 
-		create += " "+type;
-		/* if ( !field->optional ) {
-			create += " NOT NULL";
-		} */
-		}
+	std::string transactionstr = LookupParam(info, "transactions");
+	if ( !transactionstr.empty() && transactionstr == "T" )
+		transactions = true;
 
-	create += "\n);";
+	synchronous_commit = LookupParam(info, "synchronous_commit");
 
-	PGresult *res = PQexec(conn, create.c_str());
-	if ( PQresultStatus(res) != PGRES_COMMAND_OK)
+	std::string id = LookupParam(info, "id_column");
+	if ( id == "identity" )
+		id_column = ID_IDENTITY;
+	else if ( id == "none" )
+		id_column = ID_NONE;
+	else if ( ! id.empty() && id != "serial" )
 		{
-		Error(Fmt("Create command failed: %s\n", PQerrorMessage(conn)));
+		Error(Fmt("Unknown id column type '%s'", id.c_str()));
 		return false;
 		}
 
-	return CreateInsert(num_fields, fields, add_string);
-	}
+	std::string unloggedstr = LookupParam(info, "unlogged");
+	if ( !unloggedstr.empty() && unloggedstr == "T" )
+		unlogged = true;
 
-bool PostgreSQL::DoFlush(double network_time)
-	{
-	return true;
-	}
+	indexes = SplitList(LookupParam(info, "indexes"), ';');
 
-bool PostgreSQL::DoFinish(double network_time)
-	{
-	return true;
-	}
+	partition_column = LookupParam(info, "partition_column");
 
-bool PostgreSQL::DoHeartbeat(double network_time, double current_time)
-	{
-	return true;
-	}
+	if ( info.rotation_interval > 0 )
+		partition_interval = info.rotation_interval;
+	else
+		partition_interval = 86400;
 
-std::tuple<bool, std::string, int> PostgreSQL::CreateParams(const Value* val)
-	{
-	static std::regex curly_re("\\\\|\"");
+	std::string retention_action = LookupParam(info, "partition_retention_action");
+	if ( retention_action == "detach" )
+		partition_detach = true;
+	else if ( ! retention_action.empty() && retention_action != "drop" )
+		{
+		Error(Fmt("Unknown partition retention action '%s'", retention_action.c_str()));
+		return false;
+		}
 
-	if ( ! val->present )
-		return std::make_tuple(false, std::string(), 0);
+	std::string modestr = LookupParam(info, "mode");
+	if ( modestr.empty() || modestr == "insert" )
+		mode = MODE_INSERT;
+	else if ( modestr == "copy" )
+		mode = MODE_COPY;
+	else if ( modestr == "batch" )
+		mode = MODE_BATCH;
+	else if ( modestr == "merge" )
+		mode = MODE_MERGE;
+	else if ( modestr == "pipeline" )
+		{
+#ifdef LIBPQ_HAS_PIPELINING
+		mode = MODE_PIPELINE;
+#else
+		Error("pipeline mode requires libpq 14 or newer");
+		return false;
+#endif
+		}
+	else
+		{
+		Error(Fmt("Unknown write mode '%s'", modestr.c_str()));
+		return false;
+		}
 
-	std::string retval;
-	int retlength = 0;
+	uint64_t shard_count = 1;
+	uint64_t shard_queue_rows = 10000;
+	uint64_t spool_max_bytes = 1024 * 1024 * 1024;
+	uint64_t spool_segment_bytes = 64 * 1024 * 1024;
+
+	if ( ! LookupCountParam(info, "copy_max_rows", copy_max_rows) ||
+	     ! LookupCountParam(info, "copy_max_bytes", copy_max_bytes) ||
+	     ! LookupCountParam(info, "pipeline_depth", pipeline_depth) ||
+	     ! LookupCountParam(info, "batch_size", batch_size) ||
+	     ! LookupCountParam(info, "commit_rows", commit_rows) ||
+	     ! LookupCountParam(info, "commit_interval", commit_interval) ||
+	     ! LookupCountParam(info, "partition_interval", partition_interval) ||
+	     ! LookupCountParam(info, "partition_retention", partition_retention) ||
+	     ! LookupCountParam(info, "spool_max_bytes", spool_max_bytes) ||
+	     ! LookupCountParam(info, "spool_segment_bytes", spool_segment_bytes) ||
+	     ! LookupCountParam(info, "spool_latency", spool_latency) ||
+	     ! LookupCountParam(info, "spool_retry", spool_retry) ||
+	     ! LookupCountParam(info, "spool_replay_rows", spool_replay_rows) ||
+	     ! LookupCountParam(info, "shards", shard_count) ||
+	     ! LookupCountParam(info, "shard_queue_rows", shard_queue_rows) )
+		return false;
 
-	switch ( val->type ) {
+	if ( partition_interval == 0 )
+		{
+		Error("partition_interval has to be greater than zero");
+		return false;
+		}
 
-	case zeek::TYPE_BOOL:
-		retval = val->val.int_val ? "T" : "F";
-		break;
+	if ( transactions && mode != MODE_INSERT && mode != MODE_BATCH )
+		Warning("transactions are only supported in insert and batch mode and will not be used");
 
-	case zeek::TYPE_INT:
-		retval = std::to_string(val->val.int_val);
-		break;
+	buffered = IsBuf();
 
-	case zeek::TYPE_COUNT:
-		retval = std::to_string(val->val.uint_val);
-		break;
+	if ( batch_size == 0 )
+		batch_size = 1;
 
-	case zeek::TYPE_PORT:
-		retval = std::to_string(val->val.port_val.port);
-		break;
+	if ( pipeline_depth == 0 )
+		pipeline_depth = 1;
 
-	case zeek::TYPE_SUBNET:
-		retval = io->Render(val->val.subnet_val);
-		break;
+	if ( mode == MODE_COPY && ! add_string.empty() )
+		Warning("sql_addition is not supported in copy mode and will be ignored");
 
-	case zeek::TYPE_ADDR:
-		retval = io->Render(val->val.addr_val);
-		break;
+	if ( spool_replay_rows == 0 )
+		spool_replay_rows = 1;
 
-	case zeek::TYPE_TIME:
-	case zeek::TYPE_INTERVAL:
-	case zeek::TYPE_DOUBLE:
-		retval = std::to_string(val->val.double_val);
-		break;
+	side = SharedConnection::Get(conninfo);
 
-	case zeek::TYPE_ENUM:
-	case zeek::TYPE_STRING:
-	case zeek::TYPE_FILE:
-	case zeek::TYPE_FUNC:
-		retval = std::string(val->val.string_val.data, val->val.string_val.length);
-		break;
+	if ( zeek::BifConst::LogPostgres::pool_size > 0 )
+		{
+		pool = ConnectionPool::Get(conninfo, zeek::BifConst::LogPostgres::pool_size);
+		statement = Fmt("%s_%" PRIu64, insert_statement, ++pooled_writers);
+		}
 
-	case zeek::TYPE_TABLE:
-	case zeek::TYPE_VECTOR:
+	std::string spool_dir = LookupParam(info, "spool_dir");
+	if ( ! spool_dir.empty() && mode != MODE_INSERT )
+		Warning("spool_dir is only supported in insert mode and will be ignored");
+	else if ( ! spool_dir.empty() && pool )
+		Warning("spool_dir is not supported with a shared connection pool and will be ignored");
+	else if ( ! spool_dir.empty() && ! dictionary_names.empty() )
+		Warning("spool_dir is not supported with dictionary_columns and will be ignored");
+	else if ( ! spool_dir.empty() )
 		{
-		zeek_int_t size;
-		Value** vals;
+		spool = std::make_unique<Spool>(spool_dir, info.path, spool_max_bytes, spool_segment_bytes);
+		if ( ! spool->Open() )
+			{
+			Error(Fmt("Could not open spool: %s", spool->LastError().c_str()));
+			return false;
+			}
 
-		std::string out("{");
-		retlength = 1;
+		for ( const auto& warning : spool->Warnings() )
+			Warning(warning.c_str());
 
-		if ( val->type == zeek::TYPE_TABLE )
+		// rows left over from an earlier run are written before any new ones
+		if ( ! spool->Empty() )
 			{
-			size = val->val.set_val.size;
-			vals = val->val.set_val.vals;
+			MsgThread::Info(Fmt("Replaying %" PRIu64 " rows left in spool", spool->Rows()));
+			spooling = true;
 			}
-		else
+		}
+
+	if ( pool )
+		{
+		if ( ! Borrow() )
+			return false;
+		}
+	else
+		conn = PQconnectdb(conninfo.c_str());
+
+	bool connected = PQstatus(conn) == CONNECTION_OK;
+	if ( ! connected )
+		{
+		if ( ! spool )
 			{
-			size = val->val.vector_val.size;
-			vals = val->val.vector_val.vals;
+			Error(Fmt("Could not connect to pg (%s): %s", conninfo.c_str(), PQerrorMessage(conn)));
+			return false;
 			}
 
-		if ( ! size )
-			return std::make_tuple(true, std::string("{}"), 2);
+		// the table is created once we manage to connect
+		Warning(Fmt("Could not connect to pg (%s), spooling rows: %s", conninfo.c_str(), PQerrorMessage(conn)));
+		spooling = true;
+		}
 
-		for ( int i = 0; i < size; ++i )
-			{
-			if ( i != 0 )
-				out += ", ";
+	table_name = info.path;
+	table = EscapeIdentifier(info.path);
+	if ( table.empty() )
+		return false;
 
-			auto res = CreateParams(vals[i]);
-			if ( std::get<0>(res) == false )
-				{
-				out += "NULL";
-				continue;
-				}
+	dictionary_index.assign(num_fields, -1);
+	field_columns.assign(num_fields, -1);
 
-			std::string resstr = std::get<1>(res);
-			zeek::TypeTag type = vals[i]->type;
-			// for all numeric types, we do not need escaping
-			if ( type == zeek::TYPE_BOOL || type == zeek::TYPE_INT || type == zeek::TYPE_COUNT ||
-					type == zeek::TYPE_PORT || type == zeek::TYPE_TIME ||
-					type == zeek::TYPE_INTERVAL || type == zeek::TYPE_DOUBLE )
-				out += resstr;
-			else
+	for ( int i = 0; i < num_fields; ++i )
+		{
+		if ( jsonb_names.erase(fields[i]->name) > 0 || ( jsonb_optional && fields[i]->optional ) )
+			{
+			if ( partition_column == fields[i]->name || dictionary_names.count(fields[i]->name) > 0 )
 				{
-				std::string escaped = std::regex_replace(resstr, curly_re, "\\$&");
-				out += "\"" + escaped + "\"";
-				retlength += 2+escaped.length();
+				Error(Fmt("Column %s cannot be stored in the jsonb column", fields[i]->name));
+				return false;
 				}
+
+			std::string key;
+			AppendJsonString(key, fields[i]->name, strlen(fields[i]->name));
+			jsonb_fields.push_back(i);
+			jsonb_keys.push_back(key);
+			continue;
 			}
 
-		out += "}";
-		retlength += 1;
-		retval = out;
-		break;
-		}
+		field_columns[i] = column_fields.size();
+		column_fields.push_back(i);
 
-	default:
-		Error(Fmt("unsupported field format %d", val->type ));
-		return std::make_tuple(false, std::string(), 0);
-	}
+		if ( native_types && fields[i]->type == zeek::TYPE_PORT )
+			proto_fields.push_back(i);
 
-	if ( retlength == 0 )
-		retlength = retval.length();
+		if ( dictionary_names.erase(fields[i]->name) > 0 )
+			{
+			if ( fields[i]->type != zeek::TYPE_STRING && fields[i]->type != zeek::TYPE_ENUM )
+				{
+				Error(Fmt("Dictionary column %s has to be of type string or enum", fields[i]->name));
+				return false;
+				}
 
-	return std::make_tuple(true, retval, retlength);
-	}
+			DictionaryColumn column;
+			column.field = i;
+			column.table = EscapeIdentifier((table_name + "_" + fields[i]->name + "_dict").c_str());
+			column.current = nullptr;
+			if ( column.table.empty() )
+				return false;
 
-bool PostgreSQL::DoWrite(int num_fields, const Field* const* fields, Value** vals)
-	{
-	std::vector<std::tuple<bool, std::string, int>> params; // vector in which we compile the string representation of characters
+			// the columns are only copied while their caches are empty
+			dictionary_index[i] = dictionary_columns.size();
+			dictionary_columns.push_back(column);
+			}
+
+		else if ( enum_types && fields[i]->type == zeek::TYPE_ENUM )
+			{
+			EnumColumn column;
+			column.field = i;
+			column.type = EscapeIdentifier((table_name + "_" + fields[i]->name).c_str());
+			if ( column.type.empty() )
+				return false;
+
+			enum_columns.push_back(column);
+			}
+		}
+
+	if ( ! dictionary_names.empty() )
+		{
+		Error(Fmt("Dictionary column %s not found", dictionary_names.begin()->c_str()));
+		return false;
+		}
+
+	if ( ! jsonb_names.empty() )
+		{
+		Error(Fmt("jsonb field %s not found", jsonb_names.begin()->c_str()));
+		return false;
+		}
+
+	if ( mode == MODE_MERGE )
+		{
+		for ( const auto& key : SplitList(LookupParam(info, "merge_key"), ',') )
+			{
+			int column = -1;
+
+			for ( int i = 0; i < num_fields; ++i )
+				{
+				if ( key == fields[i]->name )
+					column = field_columns[i];
+				}
+
+			if ( column < 0 )
+				{
+				Error(Fmt("Merge key column %s not found", key.c_str()));
+				return false;
+				}
+
+			merge_key.push_back(column);
+			}
+
+		if ( merge_key.empty() )
+			{
+			Error("merge mode requires merge_key");
+			return false;
+			}
+		}
+
+	// A partitioned table itself cannot be unlogged, only its partitions. A unique
+	// constraint on a partitioned table has to contain the partition key. Identity columns
+	// on partitioned tables need PostgreSQL 17, so a sequence is used for them instead.
+	create = ( partition_column.empty() ? CreateTableCommand() : std::string("CREATE TABLE") ) +
+		" IF NOT EXISTS "+table+" (\n";
+
+	if ( id_column == ID_IDENTITY && partition_column.empty() )
+		create += "id bigint GENERATED BY DEFAULT AS IDENTITY";
+	else if ( id_column == ID_IDENTITY )
+		create += "id BIGSERIAL NOT NULL";
+	else if ( id_column == ID_SERIAL && partition_column.empty() )
+		create += "id SERIAL UNIQUE NOT NULL";
+	else if ( id_column == ID_SERIAL )
+		create += "id SERIAL NOT NULL";
+
+	bool partition_column_found = false;
 
 	for ( int i = 0; i < num_fields; ++i )
-		params.push_back(CreateParams(vals[i]));
+		{
+		const Field* field = fields[i];
 
-	std::vector<const char*> params_char; // vector in which we compile the character pointers that we
-	// then pass to PQexecParams. These do not have to be cleaned up because the strings will be
-	// cleaned up automatically.
-	std::vector<int> params_length; // vector in which we compile the lengths of the parameters that we
-	// then pass to PQexecParams
+		if ( partition_column == field->name )
+			{
+			if ( field->type != zeek::TYPE_TIME && field->type != zeek::TYPE_DOUBLE )
+				{
+				Error(Fmt("Partition column %s has to be of type time", field->name));
+				return false;
+				}
 
-	for ( auto &i: params )
+			partition_column_found = true;
+			partition_timestamptz = native_types && field->type == zeek::TYPE_TIME;
+			}
+		}
+
+	for ( int i = 0; i < NumColumns(); ++i )
 		{
-		if ( std::get<0>(i) == false)
-			params_char.push_back(nullptr); // null pointer is accepted to signify NULL in parameters
-		else
-			params_char.push_back(std::get<1>(i).c_str());
+		if ( i > 0 || id_column != ID_NONE )
+			create += ",\n";
 
-		params_length.push_back(std::get<2>(i));
+		std::string escaped = ColumnName(fields, i);
+		if ( escaped.empty() )
+			return false;
+		create += escaped;
+
+		std::string type = ColumnType(fields, i);
+
+		create += " "+type;
+		/* if ( !field->optional ) {
+			create += " NOT NULL";
+		} */
 		}
 
-	assert( params_char.size() == num_fields );
-	assert( params_length.size() == num_fields );
+	if ( mode == MODE_MERGE )
+		{
+		// the conflict target of the merge
+		create += ",\nUNIQUE (";
+		for ( size_t i = 0; i < merge_key.size(); ++i )
+			create += ( i > 0 ? ", " : "" ) + ColumnName(fields, merge_key[i]);
+		create += ")";
+		}
 
-	// & of vector is legal - according to current STL standard, vector has to be saved in consecutive memory.
-	PGresult *res = PQexecParams(conn,
-			insert.c_str(),
-			params_char.size(),
-			NULL,
-			&params_char[0],
-			&params_length[0],
-			NULL,
-			0);
+	create += "\n)";
+
+	if ( ! partition_column.empty() )
+		{
+		if ( ! partition_column_found )
+			{
+			Error(Fmt("Partition column %s not found", partition_column.c_str()));
+			return false;
+			}
+
+		create += " PARTITION BY RANGE (" + EscapeIdentifier(partition_column.c_str()) + ")";
+		}
+
+	create += ";";
+
+	if ( connected && ! CreateTable(info.network_time) )
+		return false;
+
+	if ( mode == MODE_COPY )
+		{
+		if ( ! CreateCopy(num_fields, fields) )
+			return false;
+
+		GiveBack();
+		return true;
+		}
+
+	if ( mode == MODE_MERGE )
+		{
+		if ( ! CreateMerge(num_fields, fields, add_string) )
+			return false;
+
+		GiveBack();
+		return true;
+		}
+
+	param_types.assign(NumColumns(), 0);
+	row_params.resize(NumColumns());
+	row_values.resize(NumColumns());
+	row_lengths.resize(NumColumns());
+	row_formats.resize(NumColumns());
+
+	if ( mode == MODE_BATCH )
+		{
+		batch_columns.assign(NumColumns(), std::string());
+		if ( ! CreateBatchInsert(num_fields, fields, add_string) || ! SetupSession() )
+			return false;
+
+		GiveBack();
+		return true;
+		}
+
+	if ( binary_params )
+		{
+		for ( int i = 0; i < FieldColumns(); ++i )
+			{
+			int field = column_fields[i];
+			if ( dictionary_index[field] < 0 )
+				param_types[i] = GetBinaryType(fields[field]->type, fields[field]->subtype);
+			}
+		}
+
+	if ( ! CreateInsert(num_fields, fields, add_string) )
+		return false;
+
+	if ( ! connected )
+		return true;
+
+	if ( ! SetupSession() )
+		return false;
+
+	if ( shard_count > 1 )
+		{
+		std::string key = LookupParam(info, "shard_key");
+		for ( int i = 0; i < num_fields; ++i )
+			{
+			if ( key == fields[i]->name )
+				shard_key = field_columns[i];
+			}
+
+		if ( ! key.empty() && shard_key < 0 )
+			{
+			Error(Fmt("Shard key column %s not found", key.c_str()));
+			return false;
+			}
+
+		if ( mode != MODE_INSERT )
+			Warning("shards are only supported in insert mode and will not be used");
+		else if ( pool || spool || transactions )
+			Warning("shards are not supported with a connection pool, spool_dir or transactions and will not be used");
+		else if ( ! StartShards(conninfo, shard_count, shard_queue_rows) )
+			return false;
+		}
+
+#ifdef LIBPQ_HAS_PIPELINING
+	// pooled connections enter pipeline mode when they are borrowed
+	if ( mode == MODE_PIPELINE && ! pool && PQenterPipelineMode(conn) != 1 )
+		{
+		Error(Fmt("Could not enter pipeline mode: %s", PQerrorMessage(conn)));
+		return false;
+		}
+#endif
+
+	GiveBack();
+	return true;
+	}
+
+// Borrows a connection from the pool, unless we already hold one. Pooled connections may
+// have been used by other writers since we last held them; the session is set up for
+// this writer if necessary. Without a pool, the writer always holds its own connection.
+bool PostgreSQL::Borrow()
+	{
+	if ( conn || ! pool )
+		return true;
+
+	std::string error;
+	pooled = pool->Acquire(statement, error);
+	if ( ! pooled )
+		{
+		Error(Fmt("Could not connect to pg: %s", error.c_str()));
+		return false;
+		}
+
+	conn = pooled->conn;
+
+	// during DoInit, there is nothing to prepare yet
+	if ( ! insert.empty() && ! SetupSession() )
+		{
+		GiveBack();
+		return false;
+		}
+
+#ifdef LIBPQ_HAS_PIPELINING
+	if ( mode == MODE_PIPELINE && PQenterPipelineMode(conn) != 1 )
+		{
+		Error(Fmt("Could not enter pipeline mode: %s", PQerrorMessage(conn)));
+		GiveBack();
+		return false;
+		}
+#endif
+
+	return true;
+	}
+
+// gives a borrowed connection back to the pool, unless something is pending on it
+void PostgreSQL::GiveBack()
+	{
+	if ( ! pooled || in_transaction || copy_in_progress || in_flight > 0 )
+		return;
+
+#ifdef LIBPQ_HAS_PIPELINING
+	if ( PQpipelineStatus(conn) != PQ_PIPELINE_OFF )
+		PQexitPipelineMode(conn);
+#endif
+
+	pool->Release(pooled);
+	pooled = nullptr;
+	conn = nullptr;
+	}
+
+// creates the table and, if the table is partitioned, the partitions for the given time
+bool PostgreSQL::CreateTable(double time)
+	{
+	if ( ! CreateTypes() || ! CreateDictionaries() )
+		return false;
 
+	PGresult *res = PQexec(conn, create.c_str());
 	if ( PQresultStatus(res) != PGRES_COMMAND_OK)
 		{
-		Error(Fmt("Command failed: %s\n", PQerrorMessage(conn)));
+		Error(Fmt("Create command failed: %s\n", PQerrorMessage(conn)));
+		PQclear(res);
+		return false;
+		}
 
-		if ( ! ignore_errors )
+	PQclear(res);
+
+	if ( ! partition_column.empty() )
+		{
+		// rows that do not fit in any of the partitions we create end up here
+		std::string default_partition = EscapeIdentifier((table_name + "_default").c_str());
+		if ( default_partition.empty() ||
+		     ! ExecUtility(CreateTableCommand() + " IF NOT EXISTS " + default_partition + " PARTITION OF " + table + " DEFAULT;") )
+			return false;
+
+		if ( ! EnsurePartitions(time > 0 ? time : zeek::util::current_time(true)) )
+			return false;
+		}
+
+	table_ready = true;
+	return true;
+	}
+
+// prepares the insert statement on the server. Parsing and planning only happen once
+// per connection instead of on every row.
+bool PostgreSQL::Prepare()
+	{
+	PGresult *res = PQprepare(conn, statement.c_str(), insert.c_str(), param_types.size(),
+			binary_params ? &param_types[0] : NULL);
+
+	if ( PQresultStatus(res) != PGRES_COMMAND_OK )
+		{
+		Error(Fmt("Could not prepare insert statement: %s\n", PQerrorMessage(conn)));
+		PQclear(res);
+		return false;
+		}
+
+	PQclear(res);
+
+	if ( pooled )
+		pooled->prepared.insert(statement);
+
+	return true;
+	}
+
+// applies the per-session settings and prepares the insert statement. Called after
+// (re)connecting.
+bool PostgreSQL::SetupSession()
+	{
+	// pooled connections keep the settings of the writer that used them last
+	std::string current = pooled ? pooled->synchronous_commit : std::string();
+
+	if ( synchronous_commit != current )
+		{
+		PGresult *res;
+		ExecStatusType expected;
+
+		if ( synchronous_commit.empty() )
+			{
+			res = PQexec(conn, "RESET synchronous_commit;");
+			expected = PGRES_COMMAND_OK;
+			}
+		else
 			{
+			const char* value = synchronous_commit.c_str();
+			res = PQexecParams(conn, "SELECT set_config('synchronous_commit', $1, false);",
+					1, NULL, &value, NULL, NULL, 0);
+			expected = PGRES_TUPLES_OK;
+			}
+
+		if ( PQresultStatus(res) != expected )
+			{
+			Error(Fmt("Could not set synchronous_commit: %s\n", PQerrorMessage(conn)));
 			PQclear(res);
 			return false;
 			}
+
+		PQclear(res);
+
+		if ( pooled )
+			pooled->synchronous_commit = synchronous_commit;
+		}
+
+	if ( pooled && pooled->prepared.count(statement) > 0 )
+		return true;
+
+	return Prepare();
+	}
+
+// Called after the prepared insert statement failed. If this happened because the
+// connection was lost or because the server dropped the statement (e.g. after a
+// DISCARD ALL), the connection is re-established and the statement prepared again.
+// Returns true if the statement should be retried.
+bool PostgreSQL::RecoverStatement(const PGresult* res)
+	{
+	if ( PQstatus(conn) == CONNECTION_BAD )
+		{
+		// with a spool, rows are spooled while the connection is re-established in the background
+		if ( spool )
+			return false;
+
+		MsgThread::Info(Fmt("Connection to database lost, reconnecting: %s", PQerrorMessage(conn)));
+		PQreset(conn);
+
+		if ( pooled )
+			pooled->ClearSession();
+
+		if ( PQstatus(conn) != CONNECTION_OK )
+			return false;
+
+		return SetupSession();
+		}
+	else
+		{
+		// SQLSTATE 26000: invalid_sql_statement_name - prepared statement does not exist.
+		const char* sqlstate = PQresultErrorField(res, PG_DIAG_SQLSTATE);
+		if ( sqlstate == nullptr || strcmp(sqlstate, "26000") != 0 )
+			return false;
+		}
+
+	return Prepare();
+	}
+
+// sends everything that the current mode holds back. If wait is not set, we do not
+// block waiting for results that did not arrive yet.
+bool PostgreSQL::FlushPending(bool wait)
+	{
+	bool ok = true;
+
+	switch ( mode ) {
+	case MODE_COPY:
+		ok = FinishCopy();
+		break;
+
+	case MODE_PIPELINE:
+		ok = CollectPipelineResults(wait);
+		break;
+
+	case MODE_BATCH:
+		ok = FlushBatch();
+		break;
+
+	case MODE_MERGE:
+		ok = FlushMerge();
+		break;
+
+	default:
+		break;
+	}
+
+	if ( ! shards.empty() )
+		{
+		if ( wait )
+			{
+			for ( auto& shard : shards )
+				shard->Wait();
+			}
+
+		ok = CollectShardErrors() && ok;
+		}
+
+	if ( in_transaction )
+		{
+		auto open_for = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - transaction_start);
+		if ( wait || static_cast<uint64_t>(open_for.count()) >= commit_interval )
+			ok = CommitTransaction() && ok;
+		}
+
+	if ( spool && ! spool->Sync() )
+		Error(Fmt("Could not sync spool: %s", spool->LastError().c_str()));
+
+	return ok;
+	}
+
+bool PostgreSQL::UseTransactions() const
+	{
+	return transactions && buffered && ( mode == MODE_INSERT || mode == MODE_BATCH );
+	}
+
+bool PostgreSQL::BeginTransaction()
+	{
+	if ( in_transaction )
+		return true;
+
+	PGresult *res = PQexec(conn, "BEGIN;");
+	if ( PQresultStatus(res) != PGRES_COMMAND_OK )
+		{
+		Error(Fmt("Could not start transaction: %s\n", PQerrorMessage(conn)));
+		PQclear(res);
+		return false;
 		}
 
 	PQclear(res);
+	in_transaction = true;
+	has_savepoint = false;
+	transaction_rows = 0;
+	transaction_start = std::chrono::steady_clock::now();
 	return true;
 	}
 
-bool PostgreSQL::DoRotate(const char* rotated_path, double open, double close, bool terminating)
+bool PostgreSQL::CommitTransaction()
 	{
-	FinishedRotation();
+	if ( ! in_transaction )
+		return true;
+
+	in_transaction = false;
+
+	PGresult *res = PQexec(conn, "COMMIT;");
+	if ( PQresultStatus(res) != PGRES_COMMAND_OK )
+		{
+		Error(Fmt("Commit of %" PRIu64 " rows failed: %s\n", transaction_rows, PQerrorMessage(conn)));
+		CountError(transaction_rows);
+		PQclear(res);
+		return ignore_errors;
+		}
+
+	PQclear(res);
 	return true;
 	}
 
-bool PostgreSQL::DoSetBuf(bool enabled)
+// A failed statement aborts the whole transaction; all rows written in it are lost.
+void PostgreSQL::AbortTransaction()
 	{
-	// Nothing to do.
-	return true;
+	if ( ! in_transaction )
+		return;
+
+	in_transaction = false;
+
+	if ( transaction_rows > 0 )
+		Error(Fmt("Transaction aborted, %" PRIu64 " rows written in it are lost", transaction_rows));
+
+	stats.failed_rows += transaction_rows;
+
+	if ( PQstatus(conn) == CONNECTION_OK )
+		PQclear(PQexec(conn, "ROLLBACK;"));
+	}
+
+// With continue_on_errors, every statement in a transaction is preceded by a savepoint, so
+// that a failing statement only rolls back itself instead of the rows written before it.
+// The previous savepoint is released, so that they do not pile up.
+bool PostgreSQL::SetSavepoint()
+	{
+	PGresult *res = PQexec(conn, has_savepoint ? "RELEASE SAVEPOINT zeek_row; SAVEPOINT zeek_row;" : "SAVEPOINT zeek_row;");
+	bool ok = PQresultStatus(res) == PGRES_COMMAND_OK;
+	PQclear(res);
+
+	if ( ! ok )
+		{
+		Error(Fmt("Could not set savepoint: %s\n", PQerrorMessage(conn)));
+		return false;
+		}
+
+	has_savepoint = true;
+	return true;
+	}
+
+// rolls back the failed statement after the savepoint; returns false if that is not possible
+bool PostgreSQL::RollbackToSavepoint()
+	{
+	if ( ! in_transaction || ! has_savepoint || PQstatus(conn) != CONNECTION_OK )
+		return false;
+
+	PGresult *res = PQexec(conn, "ROLLBACK TO SAVEPOINT zeek_row;");
+	bool ok = PQresultStatus(res) == PGRES_COMMAND_OK;
+	PQclear(res);
+	return ok;
+	}
+
+// Executes the prepared insert statement, which inserts the given number of rows. Takes
+// care of transaction grouping and of recovering from lost connections and statements.
+// The result has to be freed by the caller.
+PGresult* PostgreSQL::ExecPrepared(int nparams, const char* const* values, const int* lengths, const int* formats, uint64_t rows)
+	{
+	if ( ! Borrow() || ( UseTransactions() && ! BeginTransaction() ) )
+		return nullptr;
+
+	bool savepoint = in_transaction && ignore_errors;
+	if ( savepoint && ! SetSavepoint() )
+		return nullptr;
+
+	std::chrono::steady_clock::time_point start;
+	if ( collect_stats )
+		start = std::chrono::steady_clock::now();
+
+	PGresult *res = PQexecPrepared(conn, statement.c_str(), nparams, values, lengths, formats, 0);
+
+	if ( PQresultStatus(res) != PGRES_COMMAND_OK )
+		{
+		if ( ! savepoint || ! RollbackToSavepoint() )
+			AbortTransaction();
+
+		if ( RecoverStatement(res) )
+			{
+			PQclear(res);
+			res = PQexecPrepared(conn, statement.c_str(), nparams, values, lengths, formats, 0);
+			}
+
+		if ( collect_stats )
+			stats.AddLatency(std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+
+		return res;
+		}
+
+	if ( collect_stats )
+		stats.AddLatency(std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+
+	if ( in_transaction )
+		{
+		transaction_rows += rows;
+		if ( transaction_rows >= commit_rows && ! CommitTransaction() )
+			{
+			PQclear(res);
+			return nullptr;
+			}
+		}
+
+	return res;
+	}
+
+bool PostgreSQL::DoFlush(double network_time)
+	{
+	bool ok = FlushPending(true);
+	GiveBack();
+	return ok;
+	}
+
+bool PostgreSQL::DoFinish(double network_time)
+	{
+	// write what we can; everything else stays in the spool for the next run
+	if ( spooling && PQstatus(conn) == CONNECTION_OK && ! need_setup )
+		ReplaySpool(spool->Rows());
+
+	bool ok = FlushPending(true);
+
+	if ( ! indexes_built && ( pool || PQstatus(conn) == CONNECTION_OK ) )
+		ok = BuildIndexes() && ok;
+
+	if ( spool && ! spool->Empty() )
+		MsgThread::Info(Fmt("%" PRIu64 " rows left in spool", spool->Rows()));
+
+	GiveBack();
+	return ok;
+	}
+
+bool PostgreSQL::DoHeartbeat(double network_time, double current_time)
+	{
+	if ( spooling )
+		ResumeFromSpool(network_time);
+
+	// make sure that the next partition exists, even without rotation. The DDL ends the
+	// current COPY, batch or transaction, so it only runs when a partition is missing, and
+	// is retried a minute after a failure rather than on every heartbeat.
+	if ( ! partition_column.empty() && network_time > 0 && network_time >= partition_retry &&
+	     ( pool || PQstatus(conn) == CONNECTION_OK ) && ! EnsurePartitions(network_time) )
+		partition_retry = network_time + 60;
+
+	bool ok = FlushPending(false);
+	GiveBack();
+
+	if ( collect_stats && current_time - stats_reported >= stats_interval )
+		ReportStats(network_time, current_time);
+
+	return ok;
+	}
+
+static bool IsStringType(zeek::TypeTag type)
+	{
+	return type == zeek::TYPE_ENUM || type == zeek::TYPE_STRING ||
+		type == zeek::TYPE_FILE || type == zeek::TYPE_FUNC;
+	}
+
+template<typename T>
+static void AppendNumber(std::string& out, T val)
+	{
+	char buf[32];
+	auto res = std::to_chars(buf, buf + sizeof(buf), val);
+	out.append(buf, res.ptr - buf);
+	}
+
+static void AppendAddr(std::string& out, const Value::addr_t& addr)
+	{
+	char buf[INET6_ADDRSTRLEN];
+
+	if ( addr.family == IPv4 )
+		inet_ntop(AF_INET, &addr.in.in4, buf, sizeof(buf));
+	else
+		inet_ntop(AF_INET6, &addr.in.in6, buf, sizeof(buf));
+
+	out += buf;
+	}
+
+// Appends a time as timestamptz literal in UTC, with microsecond precision like the server
+// stores it. Returns false for times that cannot be represented.
+static bool AppendTimestamp(std::string& out, double t)
+	{
+	if ( ! std::isfinite(t) )
+		return false;
+
+	double seconds = std::floor(t);
+	long long usec = std::llround((t - seconds) * 1e6);
+	time_t tt = static_cast<time_t>(seconds);
+
+	if ( usec >= 1000000 )
+		{
+		++tt;
+		usec -= 1000000;
+		}
+
+	struct tm tm;
+	if ( gmtime_r(&tt, &tm) == nullptr )
+		return false;
+
+	char buf[64];
+	snprintf(buf, sizeof(buf), "%04d-%02d-%02d %02d:%02d:%02d.%06lld+00",
+		 tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday, tm.tm_hour, tm.tm_min, tm.tm_sec, usec);
+
+	out += buf;
+	return true;
+	}
+
+// Appends an interval literal. Intervals are kept in seconds - without converting them to
+// days - so that they compare and sum like Zeek intervals.
+static bool AppendInterval(std::string& out, double t)
+	{
+	if ( ! std::isfinite(t) )
+		return false;
+
+	char buf[64];
+	snprintf(buf, sizeof(buf), "%.6f seconds", t);
+	out += buf;
+	return true;
+	}
+
+// appends a string as a quoted element to an array literal, escaping backslashes and quotes
+static void AppendArrayElement(std::string& out, const char* data, size_t length)
+	{
+	out += '"';
+
+	for ( size_t i = 0; i < length; ++i )
+		{
+		if ( data[i] == '\\' || data[i] == '"' )
+			out += '\\';
+
+		out += data[i];
+		}
+
+	out += '"';
+	}
+
+// appends a string to a row in the COPY text format, escaping the characters COPY treats specially
+static void AppendCopyEscaped(std::string& out, const char* data, size_t length)
+	{
+	for ( size_t i = 0; i < length; ++i )
+		{
+		switch ( data[i] ) {
+		case '\\':
+			out += "\\\\";
+			break;
+		case '\t':
+			out += "\\t";
+			break;
+		case '\n':
+			out += "\\n";
+			break;
+		case '\r':
+			out += "\\r";
+			break;
+		default:
+			out += data[i];
+		}
+		}
+	}
+
+// Appends a string as JSON string. Control characters are escaped. jsonb only accepts valid
+// UTF-8 without null characters, so null characters and bytes that are not part of a valid
+// UTF-8 sequence are written as the text \\xNN, like Zeek's ASCII writer does.
+static void AppendJsonString(std::string& out, const char* data, size_t length)
+	{
+	static const char hex[] = "0123456789abcdef";
+	const unsigned char* p = reinterpret_cast<const unsigned char*>(data);
+
+	out += '"';
+
+	for ( size_t i = 0; i < length; )
+		{
+		unsigned char c = p[i];
+
+		// length of the UTF-8 sequence starting with c; 0 if it is not valid
+		size_t n = 0;
+		if ( c < 0x80 )
+			n = 1;
+		else if ( c >= 0xc2 && c <= 0xdf )
+			n = 2;
+		else if ( c >= 0xe0 && c <= 0xef )
+			n = 3;
+		else if ( c >= 0xf0 && c <= 0xf4 )
+			n = 4;
+
+		if ( n > 1 && i + n <= length )
+			{
+			for ( size_t j = 1; j < n; ++j )
+				{
+				if ( ( p[i + j] & 0xc0 ) != 0x80 )
+					n = 0;
+				}
+
+			// overlong encodings, surrogates, and code points above U+10FFFF
+			if ( n == 3 && ( ( c == 0xe0 && p[i + 1] < 0xa0 ) || ( c == 0xed && p[i + 1] >= 0xa0 ) ) )
+				n = 0;
+			else if ( n == 4 && ( ( c == 0xf0 && p[i + 1] < 0x90 ) || ( c == 0xf4 && p[i + 1] >= 0x90 ) ) )
+				n = 0;
+			}
+		else if ( n > 1 )
+			n = 0;
+
+		if ( n == 0 || c == 0 )
+			{
+			out += "\\\\x";
+			out += hex[c >> 4];
+			out += hex[c & 0xf];
+			++i;
+			continue;
+			}
+
+		if ( c == '"' || c == '\\' )
+			{
+			out += '\\';
+			out += c;
+			}
+		else if ( c < 0x20 )
+			{
+			out += "\\u00";
+			out += hex[c >> 4];
+			out += hex[c & 0xf];
+			}
+		else
+			out.append(data + i, n);
+
+		i += n;
+		}
+
+	out += '"';
+	}
+
+// Appends the text representation of val to out. Returns false if the value is not present
+// and has to be sent as NULL, or if it cannot be rendered.
+bool PostgreSQL::CreateParams(const Value* val, std::string& out)
+	{
+	if ( ! val->present )
+		return false;
+
+	switch ( val->type ) {
+
+	case zeek::TYPE_BOOL:
+		out += val->val.int_val ? 'T' : 'F';
+		break;
+
+	case zeek::TYPE_INT:
+		AppendNumber(out, val->val.int_val);
+		break;
+
+	case zeek::TYPE_COUNT:
+		AppendNumber(out, val->val.uint_val);
+		break;
+
+	case zeek::TYPE_PORT:
+		AppendNumber(out, val->val.port_val.port);
+		break;
+
+	case zeek::TYPE_SUBNET:
+		AppendAddr(out, val->val.subnet_val.prefix);
+		out += '/';
+		AppendNumber(out, static_cast<unsigned int>(val->val.subnet_val.length));
+		break;
+
+	case zeek::TYPE_ADDR:
+		AppendAddr(out, val->val.addr_val);
+		break;
+
+	case zeek::TYPE_TIME:
+		if ( native_types )
+			return AppendTimestamp(out, val->val.double_val);
+
+		AppendNumber(out, val->val.double_val);
+		break;
+
+	case zeek::TYPE_INTERVAL:
+		if ( native_types )
+			return AppendInterval(out, val->val.double_val);
+
+		AppendNumber(out, val->val.double_val);
+		break;
+
+	case zeek::TYPE_DOUBLE:
+		// shortest representation that round-trips
+		AppendNumber(out, val->val.double_val);
+		break;
+
+	case zeek::TYPE_ENUM:
+	case zeek::TYPE_STRING:
+	case zeek::TYPE_FILE:
+	case zeek::TYPE_FUNC:
+		out.append(val->val.string_val.data, val->val.string_val.length);
+		break;
+
+	case zeek::TYPE_TABLE:
+	case zeek::TYPE_VECTOR:
+		{
+		zeek_int_t size;
+		Value** vals;
+
+		if ( val->type == zeek::TYPE_TABLE )
+			{
+			size = val->val.set_val.size;
+			vals = val->val.set_val.vals;
+			}
+		else
+			{
+			size = val->val.vector_val.size;
+			vals = val->val.vector_val.vals;
+			}
+
+		out += '{';
+
+		for ( int i = 0; i < size; ++i )
+			{
+			if ( i != 0 )
+				out += ',';
+
+			const Value* element = vals[i];
+
+			if ( ! element->present )
+				out += "NULL";
+			else if ( IsStringType(element->type) )
+				AppendArrayElement(out, element->val.string_val.data, element->val.string_val.length);
+			else if ( element->type == zeek::TYPE_ADDR || element->type == zeek::TYPE_SUBNET ||
+				  ( native_types && ( element->type == zeek::TYPE_TIME || element->type == zeek::TYPE_INTERVAL ) ) )
+				{
+				// cannot contain characters that have to be escaped, but may contain spaces
+				out += '"';
+				CreateParams(element, out);
+				out += '"';
+				}
+			else if ( element->type == zeek::TYPE_TABLE || element->type == zeek::TYPE_VECTOR )
+				{
+				std::string nested;
+				if ( ! CreateParams(element, nested) )
+					out += "NULL";
+				else
+					AppendArrayElement(out, nested.data(), nested.size());
+				}
+			// numeric types do not need escaping
+			else if ( ! CreateParams(element, out) )
+				out += "NULL";
+			}
+
+		out += '}';
+		break;
+		}
+
+	default:
+		Error(Fmt("unsupported field format %d", val->type ));
+		return false;
+	}
+
+	return true;
+	}
+
+// Returns the text representation of val in data/length. Strings are not copied; all other
+// types are rendered into text_buffer. The result is valid until the next call.
+bool PostgreSQL::RenderText(const Value* val, const char*& data, size_t& length)
+	{
+	if ( ! val->present )
+		return false;
+
+	if ( IsStringType(val->type) )
+		{
+		data = val->val.string_val.data;
+		length = val->val.string_val.length;
+		return true;
+		}
+
+	text_buffer.clear();
+	if ( ! CreateParams(val, text_buffer) )
+		return false;
+
+	data = text_buffer.data();
+	length = text_buffer.size();
+	return true;
+	}
+
+static const char* ProtoName(TransportProto proto)
+	{
+	switch ( proto ) {
+	case TRANSPORT_TCP:
+		return "tcp";
+	case TRANSPORT_UDP:
+		return "udp";
+	case TRANSPORT_ICMP:
+		return "icmp";
+	default:
+		return "unknown";
+	}
+	}
+
+// Like RenderText, for column i of a row; also renders the protocol columns of ports.
+bool PostgreSQL::RenderColumn(Value** vals, int i, const char*& data, size_t& length)
+	{
+	if ( i < FieldColumns() && dictionary_index[column_fields[i]] >= 0 )
+		{
+		const std::string* id = dictionary_columns[dictionary_index[column_fields[i]]].current;
+		if ( id == nullptr )
+			return false;
+
+		data = id->c_str();
+		length = id->size();
+		return true;
+		}
+
+	if ( i < FieldColumns() )
+		return RenderText(vals[column_fields[i]], data, length);
+
+	if ( i >= FieldColumns() + static_cast<int>(proto_fields.size()) )
+		{
+		if ( ! RenderJson(vals) )
+			return false;
+
+		data = jsonb_buffer.data();
+		length = jsonb_buffer.size();
+		return true;
+		}
+
+	const Value* val = vals[proto_fields[i - FieldColumns()]];
+	if ( ! val->present )
+		return false;
+
+	data = ProtoName(val->val.port_val.proto);
+	length = strlen(data);
+	return true;
+	}
+
+// Appends val as JSON value: numbers and booleans as such, sets and vectors as arrays, and
+// everything else as string in the text representation of the column it would have.
+// Returns false if val cannot be rendered.
+bool PostgreSQL::AppendJson(const Value* val, std::string& out)
+	{
+	if ( ! val->present )
+		{
+		out += "null";
+		return true;
+		}
+
+	switch ( val->type ) {
+
+	case zeek::TYPE_BOOL:
+		out += val->val.int_val ? "true" : "false";
+		return true;
+
+	case zeek::TYPE_INT:
+		AppendNumber(out, val->val.int_val);
+		return true;
+
+	case zeek::TYPE_COUNT:
+		AppendNumber(out, val->val.uint_val);
+		return true;
+
+	case zeek::TYPE_PORT:
+		AppendNumber(out, val->val.port_val.port);
+		return true;
+
+	case zeek::TYPE_DOUBLE:
+	case zeek::TYPE_TIME:
+	case zeek::TYPE_INTERVAL:
+		// times and intervals in seconds, regardless of native_types
+		if ( std::isfinite(val->val.double_val) )
+			AppendNumber(out, val->val.double_val);
+		else
+			out += "null";
+		return true;
+
+	case zeek::TYPE_TABLE:
+	case zeek::TYPE_VECTOR:
+		{
+		zeek_int_t size;
+		Value** vals;
+
+		if ( val->type == zeek::TYPE_TABLE )
+			{
+			size = val->val.set_val.size;
+			vals = val->val.set_val.vals;
+			}
+		else
+			{
+			size = val->val.vector_val.size;
+			vals = val->val.vector_val.vals;
+			}
+
+		out += '[';
+
+		for ( int i = 0; i < size; ++i )
+			{
+			if ( i != 0 )
+				out += ',';
+
+			if ( ! AppendJson(vals[i], out) )
+				return false;
+			}
+
+		out += ']';
+		return true;
+		}
+
+	default:
+		{
+		const char* data;
+		size_t length;
+		if ( ! RenderText(val, data, length) )
+			return false;
+
+		AppendJsonString(out, data, length);
+		return true;
+		}
+	}
+	}
+
+// Renders the fields stored in the jsonb column of a row as JSON object into jsonb_buffer.
+// Fields that are not set are left out; returns false if none of them is set, so that the
+// column is NULL.
+bool PostgreSQL::RenderJson(Value** vals)
+	{
+	jsonb_buffer.clear();
+
+	for ( size_t i = 0; i < jsonb_fields.size(); ++i )
+		{
+		const Value* val = vals[jsonb_fields[i]];
+		if ( ! val->present )
+			continue;
+
+		size_t start = jsonb_buffer.size();
+		jsonb_buffer += jsonb_buffer.empty() ? '{' : ',';
+		jsonb_buffer += jsonb_keys[i];
+		jsonb_buffer += ':';
+
+		if ( ! AppendJson(val, jsonb_buffer) )
+			jsonb_buffer.resize(start);
+		}
+
+	if ( jsonb_buffer.empty() )
+		return false;
+
+	jsonb_buffer += '}';
+	return true;
+	}
+
+// Encodes a row into the parameter arrays passed to libpq. Values are rendered into
+// row_buffer, which is reused for all rows; strings are passed without copying them.
+void PostgreSQL::EncodeRow(Value** vals)
+	{
+	std::chrono::steady_clock::time_point start;
+	if ( collect_stats )
+		start = std::chrono::steady_clock::now();
+
+	row_buffer.clear();
+
+	for ( int i = 0; i < FieldColumns(); ++i )
+		{
+		int field = column_fields[i];
+		const Value* val = vals[field];
+		EncodedParam& param = row_params[i];
+
+		param.present = val->present;
+		param.external = nullptr;
+		param.offset = row_buffer.size();
+		param.length = 0;
+		param.format = 0;
+
+		if ( ! val->present )
+			continue;
+
+		if ( dictionary_index[field] >= 0 )
+			{
+			const std::string* id = dictionary_columns[dictionary_index[field]].current;
+			param.present = id != nullptr;
+			param.external = id ? id->c_str() : nullptr;
+			param.length = id ? id->size() : 0;
+			continue;
+			}
+
+		if ( param_types[i] != 0 && CreateBinaryParams(val, row_buffer, param_types[i]) )
+			param.format = 1;
+
+		else if ( IsStringType(val->type) && val->val.string_val.data != nullptr )
+			{
+			// Zeek strings are null-terminated, as required for the text format.
+			param.external = val->val.string_val.data;
+			param.length = val->val.string_val.length;
+			continue;
+			}
+
+		else if ( ! CreateParams(val, row_buffer) )
+			{
+			param.present = false;
+			row_buffer.resize(param.offset);
+			continue;
+			}
+
+		param.length = row_buffer.size() - param.offset;
+		// text parameters have to be null-terminated
+		row_buffer += '\0';
+		}
+
+	for ( size_t i = 0; i < proto_fields.size(); ++i )
+		{
+		const Value* val = vals[proto_fields[i]];
+		EncodedParam& param = row_params[FieldColumns() + i];
+
+		param.present = val->present;
+		param.external = nullptr;
+		param.offset = 0;
+		param.length = 0;
+		param.format = 0;
+
+		// NULL for absent ports, whose value is not set
+		if ( ! val->present )
+			continue;
+
+		param.external = ProtoName(val->val.port_val.proto);
+		param.length = strlen(param.external);
+		}
+
+	if ( ! jsonb_fields.empty() )
+		{
+		EncodedParam& param = row_params[NumColumns() - 1];
+
+		param.present = RenderJson(vals);
+		param.external = jsonb_buffer.c_str();
+		param.offset = 0;
+		param.length = jsonb_buffer.size();
+		param.format = 0;
+		}
+
+	// row_buffer does not change anymore, pointers into it stay valid until the next row.
+	for ( int i = 0; i < NumColumns(); ++i )
+		{
+		const EncodedParam& param = row_params[i];
+
+		if ( ! param.present )
+			row_values[i] = nullptr; // null pointer is accepted to signify NULL in parameters
+		else if ( param.external )
+			row_values[i] = param.external;
+		else
+			row_values[i] = row_buffer.data() + param.offset;
+
+		row_lengths[i] = param.length;
+		row_formats[i] = param.format;
+		}
+
+	if ( collect_stats )
+		stats.encode_time += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	}
+
+static void AppendNetworkOrder(std::string& out, uint64_t val, int bytes)
+	{
+	for ( int i = bytes - 1; i >= 0; --i )
+		out += static_cast<char>((val >> (i * 8)) & 0xff);
+	}
+
+static void AppendInet(std::string& out, const Value::addr_t& addr, int bits, bool is_cidr)
+	{
+	// inet/cidr wire format: family, mask bits, is_cidr flag, address length, address.
+	// The server defines the family as PGSQL_AF_INET (AF_INET + 0) and PGSQL_AF_INET6
+	// (AF_INET + 1); AF_INET is 2 on all supported platforms.
+	const char pgsql_af_inet = 2;
+	const char pgsql_af_inet6 = 3;
+
+	if ( addr.family == IPv4 )
+		{
+		out += pgsql_af_inet;
+		out += static_cast<char>(bits);
+		out += static_cast<char>(is_cidr);
+		out += static_cast<char>(4);
+		out.append(reinterpret_cast<const char*>(&addr.in.in4.s_addr), 4);
+		}
+	else
+		{
+		out += pgsql_af_inet6;
+		out += static_cast<char>(bits);
+		out += static_cast<char>(is_cidr);
+		out += static_cast<char>(16);
+		out.append(reinterpret_cast<const char*>(addr.in.in6.s6_addr), 16);
+		}
+	}
+
+static void PatchNetworkOrder(std::string& out, size_t pos, uint32_t val)
+	{
+	for ( int i = 0; i < 4; ++i )
+		out[pos + i] = static_cast<char>((val >> ((3 - i) * 8)) & 0xff);
+	}
+
+// Appends val in the binary format of the type returned by GetBinaryType; type is that
+// OID. Returns false if the value cannot be represented in this format; it then has to be
+// sent as text. Nothing is appended in that case.
+bool PostgreSQL::CreateBinaryParams(const Value* val, std::string& out, Oid type)
+	{
+	switch ( val->type ) {
+	case zeek::TYPE_TABLE:
+	case zeek::TYPE_VECTOR:
+		{
+		// array wire format: number of dimensions, has-null flag, element type, then for
+		// each dimension its size and lower bound, followed by the length-prefixed elements
+		Oid element_type = GetElementType(type);
+		if ( element_type == 0 )
+			return false;
+
+		zeek_int_t size;
+		Value** vals;
+
+		if ( val->type == zeek::TYPE_TABLE )
+			{
+			size = val->val.set_val.size;
+			vals = val->val.set_val.vals;
+			}
+		else
+			{
+			size = val->val.vector_val.size;
+			vals = val->val.vector_val.vals;
+			}
+
+		size_t start = out.size();
+		AppendNetworkOrder(out, size > 0 ? 1 : 0, 4);
+		size_t flags = out.size();
+		AppendNetworkOrder(out, 0, 4);
+		AppendNetworkOrder(out, element_type, 4);
+
+		if ( size == 0 )
+			return true;
+
+		AppendNetworkOrder(out, size, 4);
+		AppendNetworkOrder(out, 1, 4);
+
+		bool has_null = false;
+
+		for ( int i = 0; i < size; ++i )
+			{
+			const Value* element = vals[i];
+
+			if ( ! element->present )
+				{
+				AppendNetworkOrder(out, static_cast<uint32_t>(-1), 4);
+				has_null = true;
+				continue;
+				}
+
+			size_t length_pos = out.size();
+			AppendNetworkOrder(out, 0, 4);
+
+			if ( IsStringType(element->type) )
+				// the binary format of text and bytea are the raw bytes
+				out.append(element->val.string_val.data, element->val.string_val.length);
+
+			else if ( element->type == zeek::TYPE_SUBNET )
+				// inet[] column - send as inet, not as cidr
+				AppendInet(out, element->val.subnet_val.prefix, element->val.subnet_val.length, false);
+
+			else if ( ! CreateBinaryParams(element, out, element_type) )
+				{
+				out.resize(start);
+				return false;
+				}
+
+			PatchNetworkOrder(out, length_pos, out.size() - length_pos - 4);
+			}
+
+		if ( has_null )
+			PatchNetworkOrder(out, flags, 1);
+
+		return true;
+		}
+
+	case zeek::TYPE_BOOL:
+		out += static_cast<char>(val->val.int_val ? 1 : 0);
+		return true;
+
+	case zeek::TYPE_INT:
+		AppendNetworkOrder(out, static_cast<uint64_t>(val->val.int_val), 8);
+		return true;
+
+	case zeek::TYPE_COUNT:
+		// does not fit into a bigint - let the server complain about the text value.
+		if ( val->val.uint_val > static_cast<uint64_t>(INT64_MAX) )
+			return false;
+
+		AppendNetworkOrder(out, val->val.uint_val, 8);
+		return true;
+
+	case zeek::TYPE_PORT:
+		AppendNetworkOrder(out, val->val.port_val.port, type == INT4OID ? 4 : 8);
+		return true;
+
+	case zeek::TYPE_TIME:
+		if ( type == TIMESTAMPTZOID )
+			{
+			// microseconds since the PostgreSQL epoch
+			if ( ! std::isfinite(val->val.double_val) )
+				return false;
+
+			AppendNetworkOrder(out, static_cast<uint64_t>(std::llround((val->val.double_val - postgres_epoch) * 1e6)), 8);
+			return true;
+			}
+		// fall through
+
+	case zeek::TYPE_INTERVAL:
+		if ( type == INTERVALOID )
+			{
+			// microseconds, days, months
+			if ( ! std::isfinite(val->val.double_val) )
+				return false;
+
+			AppendNetworkOrder(out, static_cast<uint64_t>(std::llround(val->val.double_val * 1e6)), 8);
+			AppendNetworkOrder(out, 0, 4);
+			AppendNetworkOrder(out, 0, 4);
+			return true;
+			}
+		// fall through
+
+	case zeek::TYPE_DOUBLE:
+		{
+		static_assert(sizeof(double) == sizeof(uint64_t), "unexpected size of double");
+		uint64_t bits;
+		memcpy(&bits, &val->val.double_val, sizeof(bits));
+		AppendNetworkOrder(out, bits, 8);
+		return true;
+		}
+
+	case zeek::TYPE_ADDR:
+		AppendInet(out, val->val.addr_val, val->val.addr_val.family == IPv4 ? 32 : 128, false);
+		return true;
+
+	case zeek::TYPE_SUBNET:
+		AppendInet(out, val->val.subnet_val.prefix, val->val.subnet_val.length, true);
+		return true;
+
+	default:
+		return false;
+	}
+	}
+
+bool PostgreSQL::DoWrite(int num_fields, const Field* const* fields, Value** vals)
+	{
+	bool ok;
+
+	// labels cannot be added while the database is not available
+	if ( ! enum_columns.empty() && ! spooling )
+		AddEnumLabels(vals);
+
+	if ( ! dictionary_columns.empty() )
+		LookupDictionaries(vals);
+
+	if ( mode == MODE_COPY )
+		ok = WriteCopy(num_fields, vals);
+	else if ( mode == MODE_BATCH )
+		ok = WriteBatch(num_fields, vals);
+	else if ( mode == MODE_MERGE )
+		ok = WriteMerge(num_fields, vals);
+	else
+		ok = WriteInsert(num_fields, vals);
+
+	GiveBack();
+	return ok;
+	}
+
+bool PostgreSQL::WriteInsert(int num_fields, Value** vals)
+	{
+	EncodeRow(vals);
+	num_fields = NumColumns(); // number of parameters from here on
+
+	if ( mode == MODE_PIPELINE )
+		return SendPipelined(num_fields, &row_values[0], &row_lengths[0], &row_formats[0]);
+
+	if ( ! shards.empty() )
+		return WriteSharded(num_fields);
+
+	// once rows are spooled, new rows go to the spool as well until it is replayed
+	if ( spooling )
+		return SpoolRow(num_fields);
+
+	auto start = std::chrono::steady_clock::now();
+
+	// & of vector is legal - according to current STL standard, vector has to be saved in consecutive memory.
+	PGresult *res = ExecPrepared(num_fields,
+			&row_values[0],
+			&row_lengths[0],
+			&row_formats[0],
+			1);
+
+	if ( PQresultStatus(res) != PGRES_COMMAND_OK)
+		{
+		// SQLSTATE 57014: query_canceled, e.g. by statement_timeout - not the fault of the row
+		const char* sqlstate = PQresultErrorField(res, PG_DIAG_SQLSTATE);
+		if ( spool && ( PQstatus(conn) == CONNECTION_BAD || ( sqlstate && strcmp(sqlstate, "57014") == 0 ) ) )
+			{
+			StartSpooling(Fmt("Could not write to database: %s", PQerrorMessage(conn)));
+			PQclear(res);
+			return SpoolRow(num_fields);
+			}
+
+		Error(Fmt("Command failed: %s\n", PQerrorMessage(conn)));
+		CountError(1);
+
+		if ( ! ignore_errors )
+			{
+			PQclear(res);
+			return false;
+			}
+		}
+	else
+		{
+		++stats.rows;
+		stats.bytes += RowBytes(num_fields);
+		}
+
+	PQclear(res);
+
+	if ( spool && spool_latency > 0 )
+		{
+		auto took = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start);
+		if ( static_cast<uint64_t>(took.count()) >= spool_latency )
+			StartSpooling(Fmt("Insert took %lld ms", static_cast<long long>(took.count())));
+		}
+
+	return true;
+	}
+
+// Queues the prepared insert in pipeline mode. Results are collected later; if the
+// maximum number of statements is in flight, we wait until half of them are done.
+bool PostgreSQL::SendPipelined(int nparams, const char* const* values, const int* lengths, const int* formats)
+	{
+#ifdef LIBPQ_HAS_PIPELINING
+	if ( ! Borrow() )
+		return ignore_errors;
+
+	if ( PQstatus(conn) == CONNECTION_BAD )
+		{
+		if ( in_flight > 0 )
+			Error(Fmt("Connection to database lost, %" PRIu64 " statements in flight are lost", in_flight));
+
+		in_flight = 0;
+		pipeline_syncs.clear();
+		MsgThread::Info("Reconnecting to database");
+		PQreset(conn);
+
+		if ( pooled )
+			pooled->ClearSession();
+
+		if ( PQstatus(conn) != CONNECTION_OK || ! SetupSession() || PQenterPipelineMode(conn) != 1 )
+			{
+			Error(Fmt("Could not reconnect to database: %s", PQerrorMessage(conn)));
+			return ignore_errors;
+			}
+		}
+
+	if ( need_prepare )
+		{
+		if ( PQsendPrepare(conn, statement.c_str(), insert.c_str(), param_types.size(),
+				binary_params ? &param_types[0] : NULL) != 1 ||
+		     PQpipelineSync(conn) != 1 )
+			{
+			Error(Fmt("Could not prepare insert statement: %s", PQerrorMessage(conn)));
+			return ignore_errors;
+			}
+
+		need_prepare = false;
+		++in_flight;
+		pipeline_syncs.push_back({std::chrono::steady_clock::now(), true});
+		}
+
+	if ( PQsendQueryPrepared(conn, statement.c_str(), nparams, values, lengths, formats, 0) != 1 )
+		{
+		Error(Fmt("Could not send statement: %s", PQerrorMessage(conn)));
+		return ignore_errors;
+		}
+
+	// in_flight counts the syncs, as every one of them ends with a PGRES_PIPELINE_SYNC
+	// result. Without its sync, the statement is not run until the next one is sent; the
+	// connection is most likely broken then, which the next call notices.
+	if ( PQpipelineSync(conn) != 1 )
+		{
+		Error(Fmt("Could not send statement: %s", PQerrorMessage(conn)));
+		return ignore_errors;
+		}
+
+	++in_flight;
+	pipeline_syncs.push_back({std::chrono::steady_clock::now(), false});
+	stats.bytes += RowBytes(nparams);
+
+	if ( in_flight >= pipeline_depth )
+		return CollectPipelineResults(true, pipeline_depth / 2);
+
+	return CollectPipelineResults(false);
+#else
+	return false;
+#endif
+	}
+
+// Reads the results of statements sent in pipeline mode. If wait is set, this blocks until
+// at most max_in_flight statements are outstanding; otherwise only results that already
+// arrived are processed. Failing statements are handled like in insert mode.
+bool PostgreSQL::CollectPipelineResults(bool wait, uint64_t max_in_flight)
+	{
+#ifdef LIBPQ_HAS_PIPELINING
+	bool ok = true;
+
+	if ( in_flight == 0 )
+		return true;
+
+	if ( ! wait && PQconsumeInput(conn) != 1 )
+		{
+		Error(Fmt("Could not read results from database: %s", PQerrorMessage(conn)));
+		in_flight = 0;
+		pipeline_syncs.clear();
+		return ignore_errors;
+		}
+
+	bool ended = false;
+
+	while ( in_flight > max_in_flight && ( wait || ! PQisBusy(conn) ) )
+		{
+		PGresult* res = PQgetResult(conn);
+
+		if ( res == nullptr )
+			{
+			// end of the results of one statement - or, if the connection broke,
+			// there is nothing more to come.
+			if ( PQstatus(conn) == CONNECTION_BAD )
+				{
+				Error(Fmt("Connection to database lost, %" PRIu64 " statements in flight are lost", in_flight));
+				in_flight = 0;
+				pipeline_syncs.clear();
+				return ignore_errors;
+				}
+
+			// Two ends in a row: nothing is queued anymore, and libpq would return
+			// nullptr forever. Fewer syncs were sent than we counted.
+			if ( ended )
+				{
+				Error(Fmt("Pipeline has no results for %" PRIu64 " statements in flight", in_flight));
+				in_flight = 0;
+				pipeline_syncs.clear();
+				return ignore_errors;
+				}
+
+			ended = true;
+			continue;
+			}
+
+		ended = false;
+
+		// results belong to the oldest sync in flight
+		bool prepare = ! pipeline_syncs.empty() && pipeline_syncs.front().prepare;
+
+		switch ( PQresultStatus(res) ) {
+		case PGRES_PIPELINE_SYNC:
+			--in_flight;
+
+			// the latency of an insert is the time from sending it to its sync
+			if ( ! pipeline_syncs.empty() )
+				{
+				if ( collect_stats && ! prepare )
+					stats.AddLatency(std::chrono::duration<double>(std::chrono::steady_clock::now() -
+										 pipeline_syncs.front().sent).count());
+
+				pipeline_syncs.pop_front();
+				}
+
+			break;
+
+		case PGRES_COMMAND_OK:
+			if ( ! prepare )
+				++stats.rows;
+			break;
+
+		default:
+			{
+			Error(Fmt("Command failed: %s\n", PQresultErrorMessage(res)));
+			if ( ! prepare )
+				CountError(1);
+
+			// SQLSTATE 26000: prepared statement does not exist
+			const char* sqlstate = PQresultErrorField(res, PG_DIAG_SQLSTATE);
+			if ( sqlstate != nullptr && strcmp(sqlstate, "26000") == 0 )
+				need_prepare = true;
+
+			if ( ! ignore_errors )
+				ok = false;
+			}
+		}
+
+		PQclear(res);
+		}
+
+	return ok;
+#else
+	return true;
+#endif
+	}
+
+bool PostgreSQL::StartCopy()
+	{
+	if ( ! Borrow() )
+		return false;
+
+	PGresult *res = PQexec(conn, copy.c_str());
+	if ( PQresultStatus(res) != PGRES_COPY_IN )
+		{
+		Error(Fmt("Copy command failed: %s\n", PQerrorMessage(conn)));
+		PQclear(res);
+		return false;
+		}
+
+	PQclear(res);
+	copy_in_progress = true;
+	copy_rows = 0;
+	copy_bytes = 0;
+	return true;
+	}
+
+// Ends the currently running COPY (if any). Note that the server rejects the whole
+// COPY if one of the rows is invalid; with continue_on_errors, these rows are lost.
+bool PostgreSQL::FinishCopy()
+	{
+	if ( ! copy_in_progress )
+		return true;
+
+	copy_in_progress = false;
+
+	bool ok = true;
+
+	std::chrono::steady_clock::time_point start;
+	if ( collect_stats )
+		start = std::chrono::steady_clock::now();
+
+	if ( PQputCopyEnd(conn, nullptr) != 1 )
+		{
+		Error(Fmt("Could not finish copy: %s\n", PQerrorMessage(conn)));
+		ok = false;
+		}
+
+	PGresult *res;
+	while ( (res = PQgetResult(conn)) != nullptr )
+		{
+		if ( ok && PQresultStatus(res) != PGRES_COMMAND_OK )
+			{
+			Error(Fmt("Copy of %" PRIu64 " rows failed: %s\n", copy_rows, PQerrorMessage(conn)));
+			ok = false;
+			}
+
+		PQclear(res);
+		}
+
+	if ( collect_stats )
+		stats.AddLatency(std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+
+	if ( ok )
+		{
+		stats.rows += copy_rows;
+		stats.bytes += copy_bytes;
+		}
+	else
+		CountError(copy_rows);
+
+	return ok || ignore_errors;
+	}
+
+// Renders a row in the COPY text format. Values are escaped as required by COPY; the
+// rendering of the values themselves is the same that is used for INSERT parameters.
+void PostgreSQL::EncodeCopyRow(int num_fields, Value** vals)
+	{
+	std::chrono::steady_clock::time_point start;
+	if ( collect_stats )
+		start = std::chrono::steady_clock::now();
+
+	copy_row.clear();
+	copy_columns.clear();
+
+	for ( int i = 0; i < NumColumns(); ++i )
+		{
+		if ( i != 0 )
+			copy_row += '\t';
+
+		copy_columns.push_back(copy_row.size());
+
+		const char* data;
+		size_t length;
+		if ( ! RenderColumn(vals, i, data, length) )
+			copy_row += "\\N";
+		else
+			AppendCopyEscaped(copy_row, data, length);
+		}
+
+	copy_columns.push_back(copy_row.size());
+	copy_row += '\n';
+
+	if ( collect_stats )
+		stats.encode_time += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	}
+
+bool PostgreSQL::WriteCopy(int num_fields, Value** vals)
+	{
+	EncodeCopyRow(num_fields, vals);
+
+	if ( ! copy_in_progress && ! StartCopy() )
+		return ignore_errors;
+
+	if ( PQputCopyData(conn, copy_row.data(), copy_row.size()) != 1 )
+		{
+		Error(Fmt("Could not send copy data: %s\n", PQerrorMessage(conn)));
+		FinishCopy();
+		return ignore_errors;
+		}
+
+	++copy_rows;
+	copy_bytes += copy_row.size();
+
+	if ( copy_rows >= copy_max_rows || copy_bytes >= copy_max_bytes )
+		return FinishCopy();
+
+	return true;
+	}
+
+bool PostgreSQL::WriteBatch(int num_fields, Value** vals)
+	{
+	std::chrono::steady_clock::time_point start;
+	if ( collect_stats )
+		start = std::chrono::steady_clock::now();
+
+	for ( int i = 0; i < NumColumns(); ++i )
+		{
+		std::string& column = batch_columns[i];
+		column += batch_rows == 0 ? '{' : ',';
+
+		const char* data;
+		size_t length;
+		if ( ! RenderColumn(vals, i, data, length) )
+			column += "NULL";
+		else
+			AppendArrayElement(column, data, length);
+		}
+
+	++batch_rows;
+
+	if ( collect_stats )
+		stats.encode_time += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+	if ( batch_rows >= batch_size )
+		return FlushBatch();
+
+	return true;
+	}
+
+// Inserts all rows collected for the current batch with one statement. Like with COPY, the
+// whole batch fails if one row is invalid; with continue_on_errors, these rows are lost.
+bool PostgreSQL::FlushBatch()
+	{
+	if ( batch_rows == 0 )
+		return true;
+
+	std::vector<const char*> params_char;
+	params_char.reserve(batch_columns.size());
+
+	for ( auto& column : batch_columns )
+		{
+		column += '}';
+		params_char.push_back(column.c_str());
+		}
+
+	PGresult *res = ExecPrepared(params_char.size(), &params_char[0], NULL, NULL, batch_rows);
+
+	bool ok = true;
+
+	if ( PQresultStatus(res) != PGRES_COMMAND_OK )
+		{
+		Error(Fmt("Batch insert of %" PRIu64 " rows failed: %s\n", batch_rows, PQerrorMessage(conn)));
+		CountError(batch_rows);
+		ok = ignore_errors;
+		}
+	else
+		{
+		stats.rows += batch_rows;
+		for ( const auto& column : batch_columns )
+			stats.bytes += column.size();
+		}
+
+	PQclear(res);
+
+	for ( auto& column : batch_columns )
+		column.clear();
+
+	batch_rows = 0;
+
+	return ok;
+	}
+
+// Preformat the statements used in MODE_MERGE. The staging table is a temporary table with
+// the columns of the table; its rows are deleted when the merge is committed. Without
+// sql_addition, rows with an existing key update all other columns.
+bool PostgreSQL::CreateMerge(int num_fields, const Field* const * fields, const std::string& add_string)
+	{
+	std::string stage = EscapeIdentifier((table_name + "_stage").c_str());
+	if ( stage.empty() )
+		return false;
+
+	std::string columns;
+	std::string keys;
+	std::string updates;
+
+	for ( int i = 0; i < NumColumns(); ++i )
+		{
+		std::string name = ColumnName(fields, i);
+		if ( name.empty() )
+			return false;
+
+		columns += ( i > 0 ? ", " : "" ) + name;
+
+		if ( std::find(merge_key.begin(), merge_key.end(), i) != merge_key.end() )
+			keys += ( keys.empty() ? "" : ", " ) + name;
+		else
+			updates += ( updates.empty() ? "" : ", " ) + name + " = EXCLUDED." + name;
+		}
+
+	// the staging table exists for the lifetime of the session, which can be a pooled one
+	merge_create_stage = "BEGIN; SET LOCAL client_min_messages TO warning; "
+		"CREATE TEMPORARY TABLE IF NOT EXISTS " + stage + " ON COMMIT DELETE ROWS AS SELECT " +
+		columns + " FROM " + table + " WITH NO DATA;";
+
+	merge_copy = "COPY " + stage + " ( " + columns + " ) FROM STDIN;";
+
+	std::string conflict = add_string;
+	if ( conflict.empty() && updates.empty() )
+		conflict = "ON CONFLICT (" + keys + ") DO NOTHING";
+	else if ( conflict.empty() )
+		conflict = "ON CONFLICT (" + keys + ") DO UPDATE SET " + updates;
+
+	merge_insert = "INSERT INTO " + table + " ( " + columns + " ) SELECT " + columns + " FROM " + stage + " " + conflict + ";";
+
+	return true;
+	}
+
+// Adds a row to the current merge batch. A row with the same key as an earlier row of the
+// batch replaces it, as merging both would fail with ON CONFLICT DO UPDATE.
+bool PostgreSQL::WriteMerge(int num_fields, Value** vals)
+	{
+	EncodeCopyRow(num_fields, vals);
+
+	// columns are tab-separated and escaped, so the concatenation is unambiguous
+	std::string key;
+	for ( int column : merge_key )
+		key.append(copy_row, copy_columns[column], copy_columns[column + 1] - copy_columns[column]).append("\t");
+
+	auto it = merge_index.find(key);
+	if ( it != merge_index.end() )
+		merge_rows[it->second] = copy_row;
+	else
+		{
+		merge_index.emplace(std::move(key), merge_rows.size());
+		merge_rows.push_back(copy_row);
+		}
+
+	if ( merge_rows.size() >= batch_size )
+		return FlushMerge();
+
+	return true;
+	}
+
+// Copies the rows of the current merge batch into the staging table, and inserts them into
+// the table. If anything fails, the transaction is rolled back and all rows of the batch
+// are lost.
+bool PostgreSQL::FlushMerge()
+	{
+	if ( merge_rows.empty() )
+		return true;
+
+	uint64_t rows = merge_rows.size();
+	uint64_t bytes = 0;
+	bool ok = Borrow();
+
+	std::chrono::steady_clock::time_point start;
+	if ( collect_stats )
+		start = std::chrono::steady_clock::now();
+
+	PGresult *res = ok ? PQexec(conn, merge_create_stage.c_str()) : nullptr;
+	ok = ok && PQresultStatus(res) == PGRES_COMMAND_OK;
+	PQclear(res);
+
+	res = ok ? PQexec(conn, merge_copy.c_str()) : nullptr;
+	ok = ok && PQresultStatus(res) == PGRES_COPY_IN;
+	PQclear(res);
+
+	if ( ok )
+		{
+		for ( const auto& row : merge_rows )
+			{
+			if ( PQputCopyData(conn, row.data(), row.size()) != 1 )
+				{
+				ok = false;
+				break;
+				}
+
+			bytes += row.size();
+			}
+
+		ok = PQputCopyEnd(conn, ok ? nullptr : "could not send rows") == 1 && ok;
+
+		while ( (res = PQgetResult(conn)) != nullptr )
+			{
+			ok = ok && PQresultStatus(res) == PGRES_COMMAND_OK;
+			PQclear(res);
+			}
+		}
+
+	res = ok ? PQexec(conn, merge_insert.c_str()) : nullptr;
+	ok = ok && PQresultStatus(res) == PGRES_COMMAND_OK;
+	PQclear(res);
+
+	res = ok ? PQexec(conn, "COMMIT;") : nullptr;
+	ok = ok && PQresultStatus(res) == PGRES_COMMAND_OK;
+	PQclear(res);
+
+	if ( collect_stats )
+		stats.AddLatency(std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+
+	merge_rows.clear();
+	merge_index.clear();
+
+	if ( ok )
+		{
+		stats.rows += rows;
+		stats.bytes += bytes;
+		return true;
+		}
+
+	if ( conn )
+		{
+		Error(Fmt("Merge of %" PRIu64 " rows failed: %s\n", rows, PQerrorMessage(conn)));
+
+		if ( PQstatus(conn) == CONNECTION_OK && PQtransactionStatus(conn) != PQTRANS_IDLE )
+			PQclear(PQexec(conn, "ROLLBACK;"));
+		}
+
+	CountError(rows);
+	return ignore_errors;
+	}
+
+// Executes a statement that is not an insert and returns its result. Pending rows are sent
+// first, as the connection cannot be used for anything else during a COPY or in pipeline mode.
+PGresult* PostgreSQL::ExecUtilityQuery(const std::string& statement, int nparams, const char* const* values)
+	{
+	FlushPending(true);
+
+	if ( ! Borrow() )
+		return nullptr;
+
+#ifdef LIBPQ_HAS_PIPELINING
+	bool pipeline = PQpipelineStatus(conn) != PQ_PIPELINE_OFF;
+	if ( pipeline )
+		PQexitPipelineMode(conn);
+#endif
+
+	PGresult *res = PQexecParams(conn, statement.c_str(), nparams, NULL, values, NULL, NULL, 0);
+
+#ifdef LIBPQ_HAS_PIPELINING
+	if ( pipeline )
+		PQenterPipelineMode(conn);
+#endif
+
+	return res;
+	}
+
+bool PostgreSQL::ExecUtility(const std::string& statement)
+	{
+	PGresult *res = ExecUtilityQuery(statement);
+	bool ok = true;
+
+	if ( PQresultStatus(res) != PGRES_COMMAND_OK )
+		{
+		Error(Fmt("Command failed: %s\n%s", PQerrorMessage(conn), statement.c_str()));
+		ok = false;
+		}
+
+	PQclear(res);
+	return ok;
+	}
+
+std::string PostgreSQL::PartitionName(uint64_t start)
+	{
+	return table_name + "_p" + std::to_string(start);
+	}
+
+std::string PostgreSQL::PartitionBound(uint64_t time)
+	{
+	if ( ! partition_timestamptz )
+		return std::to_string(time);
+
+	std::string bound = "'";
+	AppendTimestamp(bound, time);
+	return bound + "'";
+	}
+
+// creates the partition containing the given time, as well as the following one, unless
+// they were created before. Creating them ends what is pending on the connection; they are
+// not created over a connection of their own, as that would wait for the lock on the parent
+// table that the rows pending here hold.
+bool PostgreSQL::EnsurePartitions(double time)
+	{
+	uint64_t start = static_cast<uint64_t>(time / partition_interval) * partition_interval;
+
+	if ( start + 2 * partition_interval <= partition_until )
+		return true;
+
+	if ( ! Borrow() )
+		return false;
+
+	for ( int i = 0; i < 2; ++i, start += partition_interval )
+		{
+		uint64_t end = start + partition_interval;
+		if ( end <= partition_until )
+			continue;
+
+		std::string name = EscapeIdentifier(PartitionName(start).c_str());
+		if ( name.empty() )
+			return false;
+
+		if ( ! ExecUtility(CreateTableCommand() + " IF NOT EXISTS " + name + " PARTITION OF " + table +
+				" FOR VALUES FROM (" + PartitionBound(start) + ") TO (" + PartitionBound(end) + ");") )
+			return false;
+
+		partition_until = end;
+		}
+
+	return true;
+	}
+
+// drops or detaches all partitions that only contain rows older than the retention period
+bool PostgreSQL::ExpirePartitions(double time)
+	{
+	if ( partition_retention == 0 || time < partition_retention )
+		return true;
+
+	if ( ! Borrow() )
+		return false;
+
+	double cutoff = time - partition_retention;
+
+	const char* parent = table.c_str();
+	PGresult *res = ExecUtilityQuery("SELECT c.relname FROM pg_inherits i JOIN pg_class c ON c.oid = i.inhrelid "
+			"WHERE i.inhparent = $1::regclass;", 1, &parent);
+
+	if ( PQresultStatus(res) != PGRES_TUPLES_OK )
+		{
+		Error(Fmt("Could not list partitions: %s\n", PQerrorMessage(conn)));
+		PQclear(res);
+		return false;
+		}
+
+	std::vector<std::string> expired;
+	std::string prefix = table_name + "_p";
+
+	for ( int i = 0; i < PQntuples(res); ++i )
+		{
+		std::string name = PQgetvalue(res, i, 0);
+		if ( name.compare(0, prefix.size(), prefix) != 0 )
+			continue;
+
+		char* end;
+		uint64_t start = strtoull(name.c_str() + prefix.size(), &end, 10);
+		if ( *end != '\0' )
+			continue;
+
+		if ( start + partition_interval <= cutoff )
+			expired.push_back(name);
+		}
+
+	PQclear(res);
+
+	bool ok = true;
+
+	for ( const auto& name : expired )
+		{
+		std::string escaped = EscapeIdentifier(name.c_str());
+		if ( escaped.empty() )
+			return false;
+
+		if ( partition_detach )
+			ok = ExecUtility("ALTER TABLE " + table + " DETACH PARTITION " + escaped + ";") && ok;
+		else
+			ok = ExecUtility("DROP TABLE " + escaped + ";") && ok;
+		}
+
+	return ok;
+	}
+
+bool PostgreSQL::DoRotate(const char* rotated_path, double open, double close, bool terminating)
+	{
+	if ( ! partition_column.empty() && ! terminating && ( pool || PQstatus(conn) == CONNECTION_OK ) )
+		{
+		// failures are reported, but do not stop the writer - rows end up in the
+		// default partition if their partition is missing.
+		EnsurePartitions(close);
+		ExpirePartitions(close);
+		GiveBack();
+		}
+
+	if ( ! indexes_built && ( pool || PQstatus(conn) == CONNECTION_OK ) )
+		{
+		BuildIndexes();
+		GiveBack();
+		}
+
+	FinishedRotation();
+	return true;
+	}
+
+// Unbuffered streams use autocommit, so that rows become visible immediately.
+bool PostgreSQL::DoSetBuf(bool enabled)
+	{
+	buffered = enabled;
+
+	if ( ! buffered )
+		{
+		bool ok = FlushPending(true);
+		GiveBack();
+		return ok;
+		}
+
+	return true;
+	}
+
+// Appends the current row to the spool. Rows that the spool does not accept (because it is
+// full or on I/O errors) are lost; this is reported once, not for every row.
+bool PostgreSQL::SpoolRow(int nparams)
+	{
+	if ( ! spool->Append(nparams, &row_values[0], &row_lengths[0], &row_formats[0]) )
+		{
+		if ( spool_dropped++ == 0 )
+			Error(Fmt("Could not spool row, dropping rows: %s", spool->LastError().c_str()));
+
+		return true;
+		}
+
+	if ( spool_dropped > 0 )
+		{
+		Warning(Fmt("%" PRIu64 " rows were dropped while the spool did not accept them", spool_dropped));
+		spool_dropped = 0;
+		}
+
+	return true;
+	}
+
+void PostgreSQL::StartSpooling(const char* reason)
+	{
+	if ( spooling )
+		return;
+
+	Warning(Fmt("%s - spooling rows until the database is available", reason));
+	spooling = true;
+	spool_resume = std::chrono::steady_clock::now() + std::chrono::seconds(spool_retry);
+	}
+
+// Re-establishes a lost connection without blocking the writer thread: the handshake is
+// advanced as far as it goes without waiting, and continued on the next heartbeat.
+// Returns true once the connection can be used.
+bool PostgreSQL::Reconnect(double time)
+	{
+	if ( ! reconnecting && PQstatus(conn) != CONNECTION_OK )
+		{
+		if ( PQresetStart(conn) != 1 )
+			return false;
+
+		reconnecting = true;
+		reconnect_status = PGRES_POLLING_WRITING;
+		}
+
+	while ( reconnecting )
+		{
+		struct pollfd pfd;
+		pfd.fd = PQsocket(conn);
+		pfd.events = reconnect_status == PGRES_POLLING_READING ? POLLIN : POLLOUT;
+		pfd.revents = 0;
+
+		if ( pfd.fd >= 0 && poll(&pfd, 1, 10) <= 0 )
+			return false;
+
+		reconnect_status = PQresetPoll(conn);
+
+		if ( reconnect_status == PGRES_POLLING_FAILED )
+			{
+			reconnecting = false;
+			return false;
+			}
+
+		if ( reconnect_status == PGRES_POLLING_OK )
+			{
+			reconnecting = false;
+			need_setup = true;
+			}
+		}
+
+	if ( need_setup )
+		{
+		if ( ( ! table_ready && ! CreateTable(time) ) || ! SetupSession() )
+			return false;
+
+		need_setup = false;
+		MsgThread::Info(Fmt("Connected to database, replaying %" PRIu64 " spooled rows", spool->Rows()));
+		}
+
+	return true;
+	}
+
+// called on heartbeats while rows are spooled; reconnects if necessary and replays the spool
+void PostgreSQL::ResumeFromSpool(double time)
+	{
+	auto now = std::chrono::steady_clock::now();
+	if ( ! reconnecting && now < spool_resume )
+		return;
+
+	if ( Reconnect(time) && ReplaySpool(spool_replay_rows) )
+		return;
+
+	if ( ! reconnecting )
+		spool_resume = now + std::chrono::seconds(spool_retry);
+	}
+
+// Replays up to max_rows rows from the spool. Rows are only removed from the spool once they
+// were written. Returns false if the database became unavailable again.
+bool PostgreSQL::ReplaySpool(uint64_t max_rows)
+	{
+	// replayed rows must not end up in a transaction that is rolled back later
+	if ( ! CommitTransaction() )
+		return false;
+
+	uint64_t replayed = 0;
+
+	while ( ! spool->Empty() && replayed < max_rows )
+		{
+		if ( ! spool->Read(max_rows - replayed) )
+			{
+			Error(Fmt("Could not read spool: %s", spool->LastError().c_str()));
+			return false;
+			}
+
+		if ( spool->NumRead() == 0 )
+			break;
+
+		if ( ! ReplayRows() )
+			return false;
+
+		replayed += spool->NumRead();
+		spool->Consume();
+		}
+
+	if ( spool->Empty() )
+		{
+		MsgThread::Info("All spooled rows were written to the database");
+		spooling = false;
+		}
+
+	return true;
+	}
+
+// Inserts the rows of the last Spool::Read(). Rows that fail for other reasons than a lost
+// connection are reported and dropped - they would fail again on every retry. Returns false
+// if the connection was lost; the rows are replayed again later.
+bool PostgreSQL::ReplayRows()
+	{
+	// enum labels first seen while spooling
+	for ( size_t i = 0; ! enum_columns.empty() && i < spool->NumRead(); ++i )
+		{
+		if ( ! spool->Row(i, replay_values, replay_lengths, replay_formats) )
+			continue;
+
+		for ( auto& column : enum_columns )
+			{
+			// fields in the jsonb column have no parameter of their own
+			if ( field_columns[column.field] < 0 )
+				continue;
+
+			size_t param = field_columns[column.field];
+			if ( param < replay_values.size() && replay_values[param] )
+				AddEnumLabel(column, replay_values[param], replay_lengths[param]);
+			}
+		}
+
+	if ( ReplayPipelined() )
+		return true;
+
+	if ( PQstatus(conn) == CONNECTION_BAD )
+		return false;
+
+	// one row at a time, to find the rows that fail
+	for ( size_t i = 0; i < spool->NumRead(); ++i )
+		{
+		if ( ! spool->Row(i, replay_values, replay_lengths, replay_formats) )
+			{
+			Error("Dropping corrupt row in spool");
+			continue;
+			}
+
+		PGresult *res = PQexecPrepared(conn, statement.c_str(), replay_values.size(),
+				&replay_values[0], &replay_lengths[0], &replay_formats[0], 0);
+
+		if ( PQresultStatus(res) != PGRES_COMMAND_OK )
+			{
+			if ( PQstatus(conn) == CONNECTION_BAD )
+				{
+				PQclear(res);
+				return false;
+				}
+
+			Error(Fmt("Dropping spooled row that cannot be inserted: %s\n", PQerrorMessage(conn)));
+			}
+
+		PQclear(res);
+		}
+
+	return true;
+	}
+
+// Sends all rows of the last Spool::Read() in pipeline mode with a single sync point, so the
+// rows are inserted in one implicit transaction without waiting for each of them. Returns
+// false if any of the rows failed; none of them are inserted in that case.
+bool PostgreSQL::ReplayPipelined()
+	{
+#ifdef LIBPQ_HAS_PIPELINING
+	if ( PQenterPipelineMode(conn) != 1 )
+		return false;
+
+	bool ok = true;
+
+	for ( size_t i = 0; ok && i < spool->NumRead(); ++i )
+		{
+		ok = spool->Row(i, replay_values, replay_lengths, replay_formats) &&
+			PQsendQueryPrepared(conn, statement.c_str(), replay_values.size(),
+					&replay_values[0], &replay_lengths[0], &replay_formats[0], 0) == 1;
+		}
+
+	if ( PQpipelineSync(conn) != 1 )
+		ok = false;
+	else
+		{
+		for ( ;; )
+			{
+			PGresult *res = PQgetResult(conn);
+
+			if ( res == nullptr )
+				{
+				if ( PQstatus(conn) == CONNECTION_BAD )
+					return false;
+
+				continue;
+				}
+
+			ExecStatusType status = PQresultStatus(res);
+			PQclear(res);
+
+			if ( status == PGRES_PIPELINE_SYNC )
+				break;
+
+			if ( status != PGRES_COMMAND_OK )
+				ok = false;
+			}
+		}
+
+	PQexitPipelineMode(conn);
+	return ok;
+#else
+	return false;
+#endif
+	}
+
+// Starts the shard workers. Each of them gets its own connection; the writer's connection
+// is only used for creating the table and partitions.
+bool PostgreSQL::StartShards(const std::string& conninfo, uint64_t count, uint64_t max_queued)
+	{
+	for ( uint64_t i = 0; i < count; ++i )
+		{
+		auto shard = std::make_unique<ShardWorker>(conninfo, statement, insert, param_types, synchronous_commit, max_queued);
+
+		std::string error;
+		if ( ! shard->Start(error) )
+			{
+			Error(Fmt("Could not start shard %" PRIu64 ": %s", i, error.c_str()));
+			return false;
+			}
+
+		shards.push_back(std::move(shard));
+		}
+
+	return true;
+	}
+
+// FNV-1a; only has to spread the keys evenly over the shards
+static uint64_t HashKey(const char* data, size_t length)
+	{
+	uint64_t hash = 14695981039346656037ULL;
+
+	for ( size_t i = 0; i < length; ++i )
+		{
+		hash ^= static_cast<uint8_t>(data[i]);
+		hash *= 1099511628211ULL;
+		}
+
+	return hash;
+	}
+
+// Hands the current row to a shard worker. Failures of rows handed over earlier are reported
+// here, like pipeline mode reports failures once their results arrive.
+bool PostgreSQL::WriteSharded(int num_fields)
+	{
+	uint64_t shard;
+
+	if ( shard_key < 0 )
+		shard = next_shard++;
+	else if ( row_values[shard_key] == nullptr )
+		shard = 0;
+	else
+		shard = HashKey(row_values[shard_key], row_lengths[shard_key]);
+
+	shards[shard % shards.size()]->Add(num_fields, &row_values[0], &row_lengths[0], &row_formats[0]);
+
+	return CollectShardErrors();
+	}
+
+bool PostgreSQL::CollectShardErrors()
+	{
+	// rows count once the database accepted them
+	for ( auto& shard : shards )
+		{
+		shard->TakeErrors(shard_errors);
+		shard->TakeWritten(stats.rows, stats.bytes);
+		}
+
+	bool ok = shard_errors.empty() || ignore_errors;
+
+	for ( const auto& error : shard_errors )
+		{
+		Error(error.c_str());
+		++stats.errors;
+		}
+
+	shard_errors.clear();
+	return ok;
+	}
+
+// executes a statement creating a type, ignoring the error if the type exists already
+bool PostgreSQL::CreateType(const std::string& create_type)
+	{
+	return ExecUtility("DO $$ BEGIN " + create_type + " EXCEPTION WHEN duplicate_object THEN NULL; END $$;");
+	}
+
+// Creates the enum types used by native_types and enum_types, and loads the labels the
+// enum types of the columns have already.
+bool PostgreSQL::CreateTypes()
+	{
+	if ( ! proto_fields.empty() &&
+	     ! CreateType(std::string("CREATE TYPE ") + proto_type + " AS ENUM ('unknown', 'tcp', 'udp', 'icmp');") )
+		return false;
+
+	for ( auto& column : enum_columns )
+		{
+		if ( ! CreateType("CREATE TYPE " + column.type + " AS ENUM ();") )
+			return false;
+
+		const char* type = column.type.c_str();
+		PGresult *res = ExecUtilityQuery("SELECT enumlabel FROM pg_enum WHERE enumtypid = $1::regtype;", 1, &type);
+
+		if ( PQresultStatus(res) != PGRES_TUPLES_OK )
+			{
+			Error(Fmt("Could not read labels of %s: %s\n", column.type.c_str(), PQerrorMessage(conn)));
+			PQclear(res);
+			return false;
+			}
+
+		for ( int i = 0; i < PQntuples(res); ++i )
+			column.labels.insert(PQgetvalue(res, i, 0));
+
+		PQclear(res);
+		}
+
+	return true;
+	}
+
+// adds the values of the enum columns of a row that their enum types do not have yet
+void PostgreSQL::AddEnumLabels(Value** vals)
+	{
+	for ( auto& column : enum_columns )
+		{
+		const Value* val = vals[column.field];
+		if ( val->present )
+			AddEnumLabel(column, val->val.string_val.data, val->val.string_val.length);
+		}
+	}
+
+void PostgreSQL::AddEnumLabel(EnumColumn& column, const char* data, size_t length)
+	{
+	std::string label(data, length);
+	if ( column.labels.count(label) > 0 || ! Borrow() )
+		return;
+
+	char* literal = PQescapeLiteral(conn, data, length);
+	if ( literal == nullptr )
+		{
+		Error(Fmt("Error while escaping label '%s': %s", label.c_str(), PQerrorMessage(conn)));
+		return;
+		}
+
+	std::string statement = "ALTER TYPE " + column.type + " ADD VALUE IF NOT EXISTS " + literal + ";";
+	PQfreemem(literal);
+
+	// The label is added over the shared connection, which commits it right away (before
+	// PostgreSQL 12, enum values cannot be added in a transaction), so the transaction,
+	// batch or pipeline of the writer connection goes on. Statements sent later see the
+	// label; a running COPY might not, so only that has to be finished first.
+	std::string error;
+	PGresult *res = side->Exec(statement, 0, nullptr, error);
+
+	if ( PQresultStatus(res) != PGRES_COMMAND_OK )
+		Error(Fmt("Could not add label '%s' to %s: %s\n", label.c_str(), column.type.c_str(), error.c_str()));
+	else
+		{
+		column.labels.insert(label);
+		FinishCopy();
+		}
+
+	PQclear(res);
+	}
+
+// counts a failed statement with the given number of rows
+void PostgreSQL::CountError(uint64_t rows)
+	{
+	++stats.errors;
+	stats.failed_rows += rows;
+
+	if ( ignore_errors )
+		++stats.ignored_errors;
+	}
+
+// size of the parameters of the current row
+uint64_t PostgreSQL::RowBytes(int nparams) const
+	{
+	uint64_t bytes = 0;
+
+	for ( int i = 0; i < nparams; ++i )
+		{
+		if ( row_values[i] )
+			bytes += row_lengths[i];
+		}
+
+	return bytes;
+	}
+
+// sends the counters since the last report to the main thread, which raises LogPostgres::writer_stats
+void PostgreSQL::ReportStats(double network_time, double current_time)
+	{
+	stats.queued = batch_rows + in_flight + ( copy_in_progress ? copy_rows : 0 ) + ( in_transaction ? transaction_rows : 0 );
+
+	for ( auto& shard : shards )
+		{
+		shard->TakeWritten(stats.rows, stats.bytes);
+		stats.queued += shard->Queued();
+		}
+
+	stats.spooled = spool ? spool->Rows() : 0;
+
+	SendOut(new StatsMessage(writer_frontend, Info().path, network_time, stats));
+
+	stats.Reset();
+	stats_reported = current_time;
+	}
+
+std::string PostgreSQL::CreateTableCommand() const
+	{
+	return unlogged ? "CREATE UNLOGGED TABLE" : "CREATE TABLE";
+	}
+
+// Creates the indexes of the indexes option. Building them in bulk once the table has
+// its rows is much cheaper than updating them on every insert. Indexes of a partitioned
+// table are created on all partitions, including the ones created later.
+bool PostgreSQL::BuildIndexes()
+	{
+	for ( size_t i = 0; i < indexes.size(); ++i )
+		{
+		std::string name = EscapeIdentifier((table_name + "_idx" + std::to_string(i)).c_str());
+		if ( name.empty() )
+			return false;
+
+		if ( ! ExecUtility("CREATE INDEX IF NOT EXISTS " + name + " ON " + table + " " + indexes[i] + ";") )
+			return false;
+		}
+
+	indexes_built = true;
+	return true;
+	}
+
+// Creates the lookup tables of the dictionary columns and loads the ids they contain.
+bool PostgreSQL::CreateDictionaries()
+	{
+	for ( auto& column : dictionary_columns )
+		{
+		if ( ! ExecUtility(CreateTableCommand() + " IF NOT EXISTS " + column.table +
+				" (id integer GENERATED BY DEFAULT AS IDENTITY PRIMARY KEY, value text UNIQUE NOT NULL);") )
+			return false;
+
+		PGresult *res = ExecUtilityQuery("SELECT id, value FROM " + column.table + ";");
+
+		if ( PQresultStatus(res) != PGRES_TUPLES_OK )
+			{
+			Error(Fmt("Could not read %s: %s\n", column.table.c_str(), PQerrorMessage(conn)));
+			PQclear(res);
+			return false;
+			}
+
+		for ( int i = 0; i < PQntuples(res); ++i )
+			CacheDictionaryId(column, PQgetvalue(res, i, 1), PQgetvalue(res, i, 0));
+
+		PQclear(res);
+		}
+
+	return true;
+	}
+
+// Sets the ids of the values of the dictionary columns of a row. Values that are not in the
+// cache are added to their lookup table; if that fails, NULL is written instead.
+void PostgreSQL::LookupDictionaries(Value** vals)
+	{
+	for ( auto& column : dictionary_columns )
+		{
+		const Value* val = vals[column.field];
+		column.current = nullptr;
+
+		if ( ! val->present )
+			continue;
+
+		std::string_view value(val->val.string_val.data, val->val.string_val.length);
+
+		auto it = column.ids.find(value);
+		if ( it != column.ids.end() )
+			column.current = &it->second;
+		else
+			column.current = AddDictionaryValue(column, value);
+		}
+	}
+
+// remembers the id of a value of a dictionary column and returns it
+const std::string* PostgreSQL::CacheDictionaryId(DictionaryColumn& column, std::string_view value, const char* id)
+	{
+	// the strings of a deque stay in place when more are added
+	column.values.emplace_back(value);
+	return &(column.ids[column.values.back()] = id);
+	}
+
+// Adds a value to the lookup table of a dictionary column and returns its id, or nullptr if
+// that failed. The value is committed right away over the shared connection, so the COPY,
+// batch, pipeline or transaction of the writer connection is not interrupted; the id is
+// valid before the row that refers to it is.
+const std::string* PostgreSQL::AddDictionaryValue(DictionaryColumn& column, std::string_view value)
+	{
+	std::string param(value);
+
+	// DO UPDATE instead of DO NOTHING, so that the id is returned if another writer
+	// added the value in the meantime
+	const char* values[] = { param.c_str() };
+	std::string error;
+	PGresult *res = side->Exec("INSERT INTO " + column.table + " (value) VALUES ($1) "
+			"ON CONFLICT (value) DO UPDATE SET value = EXCLUDED.value RETURNING id;", 1, values, error);
+
+	const std::string* id = nullptr;
+
+	if ( PQresultStatus(res) != PGRES_TUPLES_OK || PQntuples(res) != 1 )
+		Error(Fmt("Could not add '%s' to %s: %s\n", param.c_str(), column.table.c_str(), error.c_str()));
+	else
+		id = CacheDictionaryId(column, value, PQgetvalue(res, 0, 0));
+
+	PQclear(res);
+	return id;
 	}
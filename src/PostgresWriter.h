@@ -5,12 +5,22 @@
 #ifndef LOGGING_WRITER_POSTGRES_H
 #define LOGGING_WRITER_POSTGRES_H
 
-#include <memory> // for unique_ptr
+#include <chrono>
+#include <deque>
+#include <memory>
+#include <set>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
 
 #include "zeek/logging/WriterBackend.h"
-#include "zeek/threading/formatters/Ascii.h"
 #include "libpq-fe.h"
 
+#include "PostgresPool.h"
+#include "PostgresShard.h"
+#include "PostgresSpool.h"
+#include "PostgresStats.h"
+
 namespace logging { namespace writer {
 
 class PostgreSQL : public zeek::logging::WriterBackend {
@@ -36,17 +46,265 @@ protected:
 	bool DoHeartbeat(double network_time, double current_time) override;
 
 private:
+	// how rows are transferred to the server
+	enum WriteMode {
+		MODE_INSERT,	// one INSERT per row
+		MODE_COPY,	// rows are streamed into a COPY ... FROM STDIN session
+		MODE_PIPELINE,	// INSERTs are sent in libpq pipeline mode without waiting for results
+		MODE_BATCH,	// rows are collected per column and inserted using unnest() on arrays
+		MODE_MERGE,	// rows are de-duplicated, copied into a staging table and merged from there
+	};
+
 	std::string LookupParam(const WriterInfo& info, const std::string name) const;
+	bool LookupCountParam(const WriterInfo& info, const std::string name, uint64_t& value);
 	// note - EscapeIdentifier is replicated in reader
 	std::string EscapeIdentifier(const char* identifier);
-	std::tuple<bool, std::string, int> CreateParams(const zeek::threading::Value* val);
+	bool CreateParams(const zeek::threading::Value* val, std::string& out);
+	bool RenderText(const zeek::threading::Value* val, const char*& data, size_t& length);
+	bool RenderColumn(zeek::threading::Value** vals, int i, const char*& data, size_t& length);
+	bool RenderJson(zeek::threading::Value** vals);
+	bool AppendJson(const zeek::threading::Value* val, std::string& out);
+	void EncodeRow(zeek::threading::Value** vals);
+	bool CreateBinaryParams(const zeek::threading::Value* val, std::string& out, Oid type);
+	Oid GetBinaryType(int type, int subtype);
 	std::string GetTableType(int, int);
+	int FieldColumns() const	{ return column_fields.size(); }
+	int NumColumns() const	{ return column_fields.size() + proto_fields.size() + ( jsonb_fields.empty() ? 0 : 1 ); }
+	std::string ColumnName(const zeek::threading::Field* const* fields, int i);
+	std::string ColumnType(const zeek::threading::Field* const* fields, int i);
 	bool CreateInsert(int num_fields, const zeek::threading::Field* const* fields, const std::string add_string = "");
+	bool CreateBatchInsert(int num_fields, const zeek::threading::Field* const* fields, const std::string add_string);
+	bool CreateCopy(int num_fields, const zeek::threading::Field* const* fields);
+	bool WriteInsert(int num_fields, zeek::threading::Value** vals);
+	bool WriteCopy(int num_fields, zeek::threading::Value** vals);
+	bool WriteBatch(int num_fields, zeek::threading::Value** vals);
+	bool FlushBatch();
+	void EncodeCopyRow(int num_fields, zeek::threading::Value** vals);
+	bool CreateMerge(int num_fields, const zeek::threading::Field* const* fields, const std::string& add_string);
+	bool WriteMerge(int num_fields, zeek::threading::Value** vals);
+	bool FlushMerge();
+	bool FlushPending(bool wait);
+	bool Prepare();
+	bool SetupSession();
+	bool RecoverStatement(const PGresult* res);
+	PGresult* ExecPrepared(int nparams, const char* const* values, const int* lengths, const int* formats, uint64_t rows);
+	bool UseTransactions() const;
+	bool BeginTransaction();
+	bool CommitTransaction();
+	void AbortTransaction();
+	bool SetSavepoint();
+	bool RollbackToSavepoint();
+	bool SendPipelined(int nparams, const char* const* values, const int* lengths, const int* formats);
+	bool CollectPipelineResults(bool wait, uint64_t max_in_flight = 0);
+	PGresult* ExecUtilityQuery(const std::string& statement, int nparams = 0, const char* const* values = nullptr);
+	bool ExecUtility(const std::string& statement);
+	std::string PartitionName(uint64_t start);
+	std::string PartitionBound(uint64_t time);
+	bool EnsurePartitions(double time);
+	bool ExpirePartitions(double time);
+	bool StartCopy();
+	bool FinishCopy();
+	bool CreateTable(double time);
+	std::string CreateTableCommand() const;
+	bool BuildIndexes();
+	bool CreateType(const std::string& create_type);
+	bool CreateTypes();
+	bool StartShards(const std::string& conninfo, uint64_t count, uint64_t max_queued);
+	bool WriteSharded(int num_fields);
+	bool CollectShardErrors();
+	bool Borrow();
+	void GiveBack();
+	bool SpoolRow(int nparams);
+	void StartSpooling(const char* reason);
+	bool Reconnect(double time);
+	void ResumeFromSpool(double time);
+	bool ReplaySpool(uint64_t max_rows);
+	bool ReplayRows();
+	bool ReplayPipelined();
+	void CountError(uint64_t rows);
+	uint64_t RowBytes(int nparams) const;
+	void ReportStats(double network_time, double current_time);
 
-	PGconn *conn;
+	PGconn *conn; // with a pool, only set while a connection is borrowed
+
+	// shared connection pool; nullptr if the writer has its own connection. The writer
+	// borrows a connection when it has to send something, and gives it back once nothing
+	// is pending on it anymore - i.e. after each row, batch, COPY or transaction.
+	ConnectionPool* pool;
+	PooledConnection* pooled;
+	std::string statement; // name of the prepared insert statement
 
 	std::string table;
+	std::string create; // CREATE TABLE statement
+	bool table_ready; // table and partitions were created on the server
 	std::string insert;
+	std::string copy; // COPY statement; only used in MODE_COPY
+
+	WriteMode mode;
+
+	// COPY state. Rows are sent to the server as they arrive; the COPY is
+	// finished once one of the thresholds is reached, or on flush/heartbeat.
+	bool copy_in_progress;
+	uint64_t copy_rows;
+	uint64_t copy_bytes;
+	uint64_t copy_max_rows;
+	uint64_t copy_max_bytes;
+	std::string copy_row; // reused buffer for the row that is currently being encoded
+	std::vector<size_t> copy_columns; // offsets of the columns in copy_row
+
+	// pipeline state. Every statement is followed by its own sync point, so a failing
+	// statement does not affect the other ones in flight.
+	uint64_t pipeline_depth;
+	uint64_t in_flight;
+
+	// the syncs in flight, oldest first: when they were sent, and whether they end the
+	// statement that prepares the insert rather than an insert
+	struct PipelineSync {
+		std::chrono::steady_clock::time_point sent;
+		bool prepare;
+	};
+
+	std::deque<PipelineSync> pipeline_syncs;
+	bool need_prepare; // server lost the prepared statement; re-send it before the next row
+
+	// batch state. For every column, the values of all rows of the current batch are
+	// collected in an array literal, which is passed as a single parameter.
+	uint64_t batch_size;
+	uint64_t batch_rows;
+	std::vector<std::string> batch_columns;
+
+	// merge state. Rows are collected in the COPY text format, keeping only the last row for
+	// each key. On flush, they are copied into a temporary staging table and inserted into
+	// the table with a single INSERT ... SELECT ... ON CONFLICT, in one transaction.
+	std::vector<int> merge_key; // key columns
+	std::string merge_create_stage;
+	std::string merge_copy;
+	std::string merge_insert;
+	std::vector<std::string> merge_rows;
+	std::unordered_map<std::string, size_t> merge_index; // key to index in merge_rows
+
+	// transaction grouping. If enabled and the stream is buffered, rows are inserted in
+	// a transaction that is committed every commit_rows rows or commit_interval ms.
+	bool transactions;
+	bool buffered;
+	bool in_transaction;
+	bool has_savepoint; // with continue_on_errors; see SetSavepoint
+	uint64_t transaction_rows;
+	uint64_t commit_rows;
+	uint64_t commit_interval;
+	std::chrono::steady_clock::time_point transaction_start;
+
+	std::string synchronous_commit; // per-session setting; empty to use the server default
+
+	// partitioning. If partition_column is set, the table is range-partitioned on it, with
+	// one partition per partition_interval seconds. Partitions are created ahead of time
+	// and, if partition_retention is set, dropped or detached once they are old enough.
+	std::string table_name; // unescaped
+
+	// table layout for fast loading. Unlogged tables are not written to the WAL; indexes
+	// are only built on rotation and when the writer finishes, instead of being
+	// maintained on every insert.
+	enum IdColumn {
+		ID_SERIAL,	// id SERIAL with a unique constraint
+		ID_IDENTITY,	// id bigint identity column without any constraint
+		ID_NONE,	// no id column
+	};
+
+	IdColumn id_column;
+	bool unlogged;
+	std::vector<std::string> indexes; // index definitions, following ON <table>
+	bool indexes_built;
+
+	std::string partition_column;
+	uint64_t partition_interval;
+	uint64_t partition_retention;
+	bool partition_detach;
+	double partition_until; // end of the newest partition we created
+	double partition_retry; // network time before which heartbeats do not create partitions
+	bool partition_timestamptz; // partition column is a timestamptz (native_types)
+
+	// spool. If enabled, rows that cannot be inserted because the connection is down, or
+	// while inserts take longer than spool_latency ms, are appended to an on-disk spool.
+	// Once the database is available again, the spool is replayed on heartbeats; new rows
+	// are spooled as well until it is empty, so that the order of rows is kept.
+	std::unique_ptr<Spool> spool;
+	bool spooling;
+	uint64_t spool_latency;
+	uint64_t spool_retry; // seconds between attempts to reconnect and replay
+	uint64_t spool_replay_rows; // maximum rows replayed per heartbeat
+	uint64_t spool_dropped; // rows lost since the spool stopped accepting rows
+	std::chrono::steady_clock::time_point spool_resume; // next attempt to replay
+	bool reconnecting; // non-blocking connection reset in progress
+	bool need_setup; // table and session have to be set up on the new connection
+	PostgresPollingStatusType reconnect_status;
+	std::vector<const char*> replay_values;
+	std::vector<int> replay_lengths;
+	std::vector<int> replay_formats;
+
+	// shards. If enabled, rows are not inserted by the writer itself, but handed to one of
+	// several workers with their own connections - round-robin, or by hashing the value of
+	// the shard_key column, so that rows with the same key end up on the same connection.
+	std::vector<std::unique_ptr<ShardWorker>> shards;
+	int shard_key; // index of the key column; -1 for round-robin
+	uint64_t next_shard;
+	std::vector<std::string> shard_errors;
+
+	// performance counters, reported every stats_interval seconds (LogPostgres::stats_interval).
+	// Timings are only taken if the counters are collected.
+	zeek::logging::WriterFrontend* writer_frontend;
+	bool collect_stats;
+	double stats_interval;
+	double stats_reported; // current time of the last report
+	WriterStats stats;
+
+	// Columns of the table: the fields that have a column of their own, the protocol columns
+	// of ports (proto_fields), and the jsonb column holding all other fields, if there are any.
+	std::vector<int> column_fields; // field of each column
+	std::vector<int> field_columns; // column of each field; -1 if it is in the jsonb column
+	std::vector<int> jsonb_fields;
+	std::vector<std::string> jsonb_keys; // field names as JSON strings
+	std::string jsonb_column;
+	std::string jsonb_buffer;
+
+	// native types. Times are stored as timestamptz, intervals as interval and ports as
+	// integer, with an additional <name>_proto column for the protocol of each port.
+	bool native_types;
+	std::vector<int> proto_fields; // fields that have a protocol column, in column order
+
+	// enum columns that have an enum type of their own (enum_types option). Labels are
+	// added to the type when a value is seen for the first time.
+	struct EnumColumn {
+		int field;
+		std::string type; // escaped
+		std::set<std::string> labels;
+	};
+
+	std::vector<EnumColumn> enum_columns;
+	void AddEnumLabels(zeek::threading::Value** vals);
+	void AddEnumLabel(EnumColumn& column, const char* data, size_t length);
+
+	// connection for new enum labels and dictionary values, which are committed right
+	// away; shared by all writers using the same connection string
+	SharedConnection* side;
+
+	// dictionary columns (dictionary_columns option). The table stores the integer id of
+	// the value in the lookup table <table>_<column>_dict; ids of values that were seen
+	// before are cached, new values are inserted into the lookup table over a connection
+	// of their own, so that nothing pending on the writer connection has to be sent first.
+	struct DictionaryColumn {
+		int field;
+		std::string table; // escaped
+		std::deque<std::string> values; // the cached values, which the keys of ids point into
+		std::unordered_map<std::string_view, std::string> ids; // value to id, rendered as text
+		const std::string* current; // id of the value of the current row; nullptr for NULL
+	};
+
+	std::vector<DictionaryColumn> dictionary_columns;
+	std::vector<int> dictionary_index; // per field, index into dictionary_columns or -1
+	bool CreateDictionaries();
+	void LookupDictionaries(zeek::threading::Value** vals);
+	const std::string* AddDictionaryValue(DictionaryColumn& column, std::string_view value);
+	static const std::string* CacheDictionaryId(DictionaryColumn& column, std::string_view value, const char* id);
 
 	std::string default_hostname;
 	std::string default_dbname;
@@ -54,8 +312,30 @@ private:
 
 	bool ignore_errors;
 	bool bytea_instead_text;
+	bool binary_params;
+
+	// parameter types of the insert statement. With binary_params, every column that has
+	// a binary encoder gets its type OID here; 0 means that the column is sent as text.
+	std::vector<Oid> param_types;
+
+	// Encoded parameter of the current row. Values either live in row_buffer - referenced
+	// by offset, as the buffer may grow while the row is encoded - or, for strings, point
+	// directly to the data of the threading::Value.
+	struct EncodedParam {
+		bool present;
+		const char* external;
+		size_t offset;
+		int length;
+		int format;
+	};
 
-	std::unique_ptr<zeek::threading::formatter::Ascii> io;
+	// per-writer buffers reused for every row, so encoding a row does not allocate
+	std::string row_buffer;
+	std::string text_buffer;
+	std::vector<EncodedParam> row_params;
+	std::vector<const char*> row_values;
+	std::vector<int> row_lengths;
+	std::vector<int> row_formats;
 };
 
 }
@@ -0,0 +1,47 @@
+/*
+ * LD_PRELOAD library counting calls to malloc, calloc and realloc (which includes
+ * operator new). The count is written to the file named by ALLOC_COUNT_FILE when the
+ * process exits. glibc only.
+ */
+
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+extern void* __libc_malloc(size_t size);
+extern void* __libc_calloc(size_t nmemb, size_t size);
+extern void* __libc_realloc(void* ptr, size_t size);
+
+static atomic_ulong allocations;
+
+void* malloc(size_t size)
+	{
+	atomic_fetch_add_explicit(&allocations, 1, memory_order_relaxed);
+	return __libc_malloc(size);
+	}
+
+void* calloc(size_t nmemb, size_t size)
+	{
+	atomic_fetch_add_explicit(&allocations, 1, memory_order_relaxed);
+	return __libc_calloc(nmemb, size);
+	}
+
+void* realloc(void* ptr, size_t size)
+	{
+	atomic_fetch_add_explicit(&allocations, 1, memory_order_relaxed);
+	return __libc_realloc(ptr, size);
+	}
+
+__attribute__((destructor)) static void write_count(void)
+	{
+	const char* path = getenv("ALLOC_COUNT_FILE");
+	if ( ! path )
+		return;
+
+	FILE* f = fopen(path, "w");
+	if ( ! f )
+		return;
+
+	fprintf(f, "%lu\n", (unsigned long) atomic_load(&allocations));
+	fclose(f);
+	}
@@ -0,0 +1,212 @@
+#! /usr/bin/env python3
+#
+# Throughput benchmarks of the PostgreSQL writer and reader against a throwaway local
+# server, set up like the btests do it. See the Benchmarks section of the README.
+
+import argparse
+import json
+import os
+import resource
+import shutil
+import subprocess
+import sys
+import tempfile
+import time
+
+base = os.path.dirname(os.path.abspath(__file__))
+tests = os.path.dirname(base)
+
+# WriterStats$latency_fine_histogram: bucket 0 counts statements below 1us, bucket i those
+# below 10^(i/4) us, and the last one those of 10s and more
+fine_latency_buckets_per_decade = 4
+fine_latency_buckets = 7 * fine_latency_buckets_per_decade + 2
+
+
+def zeek_env(var):
+    return subprocess.check_output([os.path.join(tests, "Scripts", "get-zeek-env"), var], text=True).strip()
+
+
+def run(cmd, env, cwd):
+    """Runs cmd and returns its wall-clock and CPU time in seconds."""
+    before = resource.getrusage(resource.RUSAGE_CHILDREN)
+    start = time.monotonic()
+    subprocess.run(cmd, env=env, cwd=cwd, check=True, stdout=subprocess.DEVNULL)
+    elapsed = time.monotonic() - start
+    after = resource.getrusage(resource.RUSAGE_CHILDREN)
+    cpu = (after.ru_utime - before.ru_utime) + (after.ru_stime - before.ru_stime)
+    return elapsed, cpu
+
+
+def format_usec(usec):
+    if usec < 1000:
+        return "%.3gus" % usec
+    if usec < 1000000:
+        return "%.3gms" % (usec / 1000)
+    return "%.3gs" % (usec / 1000000)
+
+
+def percentile(histogram, fraction):
+    """Returns the statement latency below which the given fraction of the statements fall,
+    interpolated log-linearly within its bucket of the fine latency histogram."""
+    total = sum(histogram)
+    if total == 0:
+        return "-"
+
+    target = fraction * total
+    seen = 0
+    for i, count in enumerate(histogram):
+        if count == 0 or seen + count < target:
+            seen += count
+            continue
+
+        if i == 0:
+            return "<1us"
+        if i == len(histogram) - 1:
+            return ">=10s"
+
+        low = (i - 1) / fine_latency_buckets_per_decade
+        position = low + (target - seen) / count / fine_latency_buckets_per_decade
+        return format_usec(10 ** position)
+
+    return "-"
+
+
+class Server:
+    def __init__(self, workdir, port):
+        self.data = os.path.join(workdir, "postgres")
+        self.log = os.path.join(workdir, "serverlog")
+        self.port = port
+
+    def start(self):
+        subprocess.run(["initdb", "-D", self.data], check=True, stdout=subprocess.DEVNULL)
+        with open(os.path.join(self.data, "postgresql.conf"), "a") as conf:
+            conf.write("port = %d\n" % self.port)
+        subprocess.run(["pg_ctl", "start", "-w", "-D", self.data, "-l", self.log], check=True, stdout=subprocess.DEVNULL)
+        subprocess.run(["createdb", "-p", str(self.port), "bench"], check=True)
+
+    def stop(self):
+        subprocess.run(["pg_ctl", "stop", "-D", self.data, "-m", "fast"], stdout=subprocess.DEVNULL)
+
+
+class Benchmark:
+    def __init__(self, args, workdir):
+        self.args = args
+        self.workdir = workdir
+        self.env = dict(os.environ)
+        self.env["ZEEKPATH"] = zeek_env("zeekpath")
+        self.env["ZEEK_PLUGIN_PATH"] = zeek_env("zeek_plugin_path")
+        self.env["PATH"] = zeek_env("path")
+        self.env["TZ"] = "UTC"
+        self.alloc_lib = self.build_alloc_lib()
+
+    def build_alloc_lib(self):
+        cc = shutil.which("cc")
+        if not cc:
+            return None
+
+        lib = os.path.join(self.workdir, "alloc-count.so")
+        result = subprocess.run([cc, "-shared", "-fPIC", "-O2", "-o", lib, os.path.join(base, "alloc-count.c")])
+        return lib if result.returncode == 0 else None
+
+    def zeek(self, script, name, settings):
+        """Runs a benchmark script; returns elapsed and CPU time and the number of allocations."""
+        rundir = os.path.join(self.workdir, name)
+        os.makedirs(rundir, exist_ok=True)
+
+        env = dict(self.env)
+        allocs_file = os.path.join(rundir, "allocations")
+        if self.alloc_lib:
+            env["LD_PRELOAD"] = self.alloc_lib
+            env["ALLOC_COUNT_FILE"] = allocs_file
+
+        cmd = ["zeek", os.path.join(base, script), "Bench::port_=%d" % self.args.port]
+        cmd += ["Bench::%s=%s" % (key, value) for key, value in settings.items()]
+        elapsed, cpu = run(cmd, env, rundir)
+
+        allocs = None
+        if self.alloc_lib and os.path.exists(allocs_file):
+            with open(allocs_file) as f:
+                allocs = int(f.read())
+
+        return rundir, elapsed, cpu, allocs
+
+    def write(self, shape, mode):
+        rundir, elapsed, cpu, allocs = self.zeek("write.zeek", "%s_%s" % (shape, mode),
+                                                 {"shape": shape, "mode": mode, "rows": self.args.rows})
+
+        histogram = [0] * fine_latency_buckets
+        stats = os.path.join(rundir, "stats.json")
+        if os.path.exists(stats):
+            with open(stats) as f:
+                for line in f:
+                    s = json.loads(line)
+                    histogram = [a + b for a, b in zip(histogram, s["latency_fine_histogram"])]
+
+        return elapsed, cpu, allocs, histogram
+
+    def read(self, shape, table):
+        rundir, elapsed, cpu, allocs = self.zeek("read.zeek", "read_" + shape,
+                                                 {"shape": shape, "table_name": table})
+        with open(os.path.join(rundir, "read.out")) as f:
+            rows = int(f.read())
+
+        return rows, elapsed, cpu
+
+    def main(self):
+        rows = self.args.rows
+        print("%d rows per run; times are relative to a run with the none writer" % rows)
+        print("p50 and p99 are statement latencies; a batch or COPY statement carries many rows")
+        print()
+        print("%-6s %-9s %10s %9s %8s %11s %8s %8s" %
+              ("shape", "mode", "rows/s", "seconds", "cpu", "allocs/row", "p50", "p99"))
+
+        for shape in self.args.shapes.split(","):
+            base_elapsed, base_cpu, base_allocs, _ = self.write(shape, "none")
+
+            for mode in self.args.modes.split(","):
+                elapsed, cpu, allocs, histogram = self.write(shape, mode)
+                elapsed = max(elapsed - base_elapsed, 1e-6)
+                cpu -= base_cpu
+                per_row = "%.1f" % ((allocs - base_allocs) / rows) if allocs is not None else "-"
+
+                print("%-6s %-9s %10.0f %9.2f %8.2f %11s %8s %8s" %
+                      (shape, mode, rows / elapsed, elapsed, cpu, per_row,
+                       percentile(histogram, 0.5), percentile(histogram, 0.99)))
+                sys.stdout.flush()
+
+        print()
+        print("reader times include the startup of Zeek")
+        print("%-6s %-9s %10s %9s %8s" % ("shape", "reader", "rows/s", "seconds", "cpu"))
+
+        for shape in self.args.shapes.split(","):
+            # the table written by the first mode
+            table = "%s_%s" % (shape, self.args.modes.split(",")[0])
+            read, elapsed, cpu = self.read(shape, table)
+            print("%-6s %-9s %10.0f %9.2f %8.2f" % (shape, "select", read / elapsed, elapsed, cpu))
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Benchmarks of the PostgreSQL writer and reader")
+    parser.add_argument("--rows", type=int, default=100000, help="rows written per run")
+    parser.add_argument("--shapes", default="conn,dns,http", help="comma-separated log shapes")
+    parser.add_argument("--modes", default="insert,pipeline,batch,copy", help="comma-separated write modes")
+    parser.add_argument("--port", type=int, default=7773, help="port of the benchmark server")
+    parser.add_argument("--keep", action="store_true", help="keep the working directory")
+    args = parser.parse_args()
+
+    workdir = tempfile.mkdtemp(prefix="zeek-postgres-bench-")
+    server = Server(workdir, args.port)
+
+    try:
+        server.start()
+        Benchmark(args, workdir).main()
+    finally:
+        server.stop()
+        if args.keep:
+            print("kept %s" % workdir)
+        else:
+            shutil.rmtree(workdir, ignore_errors=True)
+
+
+if __name__ == "__main__":
+    main()